@@ -0,0 +1,387 @@
+/*
+PD_Heap - allocator benchmark over several workloads, PD_Heap against glibc
+
+    make PD-Heap-Bench && ./PD-Heap-Bench
+
+test_timing in PD-Heap-MyAlloc.c has one pattern: 64 slots, sizes 1 to 64,
+allocate or free at random. Real programs don't look like that, and a policy
+that wins there can lose badly elsewhere. Each workload here runs on every
+PD_Heap placement policy (with growth on, single-threaded) and on glibc's
+malloc, and one table reports:
+
+ns/op     - wall time per call (every malloc, free and realloc is one op)
+peak KB   - the most memory the workload made the allocator need at once,
+            above what it needed when the workload started: for PD_Heap
+            the span of each arena up to its last used block plus the big
+            mappings (myalloc_stats()), for glibc the main arena without
+            its releasable top chunk plus the mmap'd chunks (mallinfo2()).
+            Holes between used blocks count, free space at the end of an
+            arena doesn't, so a policy that packs blocks lower needs less.
+            Whole arenas would not do: every policy fits the small
+            workloads in the same 1 MiB arena
+failed %  - allocations that returned NULL
+
+The footprint is measured in a second, untimed run of the same workload that
+samples the allocator every SAMPLE_EVERY ops, so walking the heap doesn't
+show up in ns/op. That run gets a fresh process (the bench runs itself with
+-f workload allocator), so no allocator starts with memory an earlier run
+left behind: PD_Heap's KEEP_EMPTY spare arena, or the blocks glibc keeps in
+its tcache and fastbins, which malloc_trim() can't give back. The workloads
+are deterministic (glibc's rand() LCG with a fixed seed), so both runs do
+exactly the same calls.
+
+Workloads:
+churn     - 4096 slots, allocate or free a random one, 16 to 512 bytes
+lifo      - allocate a stack of up to 1000 blocks, free it in reverse order
+fifo      - producer/consumer queue of 1000 blocks, freed in allocation order
+bimodal   - churn where 1 in 10 blocks is 4 to 64 KB and the rest 16 to 64 bytes
+longshort - 2000 long-lived blocks, replaced rarely, between short-lived
+            blocks freed a few calls after they were allocated
+realloc   - 64 buffers grown by realloc() in 16 to 256 byte steps up to 64 KB
+*/
+
+#define _GNU_SOURCE
+#include <malloc.h>  /* mallinfo2 */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>  /* strcmp */
+#include <time.h>
+#include <unistd.h>  /* getpid */
+
+#include "PD-Heap-MyAlloc.h"
+
+#define OPS 1000000        /* allocator calls per workload */
+#define SAMPLE_EVERY 1024  /* ops between two footprint samples */
+
+/* One allocator under test. */
+typedef struct Allocator {
+    const char* name;
+    int policy; /* FIT_*, or -1 for glibc */
+    void* (*alloc)(size_t size);
+    void (*release)(void* ptr);
+    void* (*resize)(void* ptr, size_t size);
+    size_t (*footprint)(void);
+} Allocator;
+
+/* One run of a workload: the calls it made and what was measured. */
+typedef struct Run {
+    const Allocator* a;
+    long ops;
+    long allocs;
+    long fails;
+    int sampling;  /* the untimed footprint run */
+    size_t start;  /* footprint before the first call */
+    size_t peak;
+} Run;
+
+static void pd_free(void* ptr)
+{
+    myfree(ptr);
+}
+
+/* Arena bytes up to the last used block in each arena, plus big mappings. */
+static size_t pd_footprint(void)
+{
+    MyAllocStats st;
+    myalloc_stats(&st);
+    return st.span_bytes;
+}
+
+/* The main arena up to its top chunk (which malloc_trim() could give back), plus mmap'd chunks. */
+static size_t glibc_footprint(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena - mi.keepcost + mi.hblkhd;
+}
+
+static const Allocator allocators[] = {
+    {"next fit", FIT_NEXT, myalloc, pd_free, myrealloc, pd_footprint},
+    {"segregated", FIT_SEGREGATED, myalloc, pd_free, myrealloc, pd_footprint},
+    {"tlsf", FIT_TLSF, myalloc, pd_free, myrealloc, pd_footprint},
+    {"glibc", -1, malloc, free, realloc, glibc_footprint},
+};
+
+/*
+-------------------------------------------------------------------------------
+calls through the allocator under test
+-------------------------------------------------------------------------------
+*/
+
+static void count_op(Run* r)
+{
+    r->ops++;
+    if (r->sampling && r->ops % SAMPLE_EVERY == 0) {
+        size_t f = r->a->footprint();
+        if (f > r->peak) {
+            r->peak = f;
+        }
+    }
+}
+
+static void* b_alloc(Run* r, size_t size)
+{
+    void* p = r->a->alloc(size);
+    r->allocs++;
+    if (!p) {
+        r->fails++;
+    } else {
+        *(unsigned char*)p = 1; /* touch it, like a real caller would */
+    }
+    count_op(r);
+    return p;
+}
+
+static void b_free(Run* r, void* p)
+{
+    if (p) {
+        r->a->release(p);
+        count_op(r);
+    }
+}
+
+static void* b_realloc(Run* r, void* p, size_t size)
+{
+    void* q = r->a->resize(p, size);
+    r->allocs++;
+    if (!q) {
+        r->fails++; /* p is still valid */
+    }
+    count_op(r);
+    return q;
+}
+
+/* glibc's rand() LCG, as in PD-Heap-MyAlloc.c, the high bits are the random ones */
+static uint32_t next_rand(uint32_t* r)
+{
+    *r = *r * 1103515245 + 12345;
+    return *r >> 8;
+}
+
+/*
+-------------------------------------------------------------------------------
+workloads
+-------------------------------------------------------------------------------
+*/
+
+#define CHURN_SLOTS 4096
+
+static void* slots[CHURN_SLOTS];
+
+/* Free every slot still in use. */
+static void free_slots(Run* r, int n)
+{
+    for (int i = 0; i < n; i++) {
+        b_free(r, slots[i]);
+        slots[i] = NULL;
+    }
+}
+
+static void wl_churn(Run* r)
+{
+    uint32_t seed = 1;
+    while (r->ops < OPS) {
+        uint32_t x = next_rand(&seed);
+        int i = x % CHURN_SLOTS;
+        if (slots[i]) {
+            b_free(r, slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = b_alloc(r, 16 + (x >> 12) % 497);
+        }
+    }
+    free_slots(r, CHURN_SLOTS);
+}
+
+static void wl_lifo(Run* r)
+{
+    uint32_t seed = 2;
+    while (r->ops < OPS) {
+        int depth = 1 + next_rand(&seed) % 1000;
+        for (int i = 0; i < depth; i++) {
+            slots[i] = b_alloc(r, 16 + next_rand(&seed) % 241);
+        }
+        for (int i = depth - 1; i >= 0; i--) {
+            b_free(r, slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+static void wl_fifo(Run* r)
+{
+    const int QUEUE = 1000;
+    uint32_t seed = 3;
+    int head = 0, tail = 0; /* slots[head..tail) is the queue, modulo QUEUE */
+    for (; tail < QUEUE; tail++) {
+        slots[tail] = b_alloc(r, 16 + next_rand(&seed) % 241);
+    }
+    while (r->ops < OPS) {
+        b_free(r, slots[head]); /* consumer: the oldest message */
+        head = (head + 1) % QUEUE;
+        slots[tail % QUEUE] = b_alloc(r, 16 + next_rand(&seed) % 241); /* producer */
+        tail = (tail + 1) % QUEUE;
+    }
+    free_slots(r, QUEUE);
+}
+
+static void wl_bimodal(Run* r)
+{
+    uint32_t seed = 4;
+    while (r->ops < OPS) {
+        uint32_t x = next_rand(&seed);
+        int i = x % 1024;
+        if (slots[i]) {
+            b_free(r, slots[i]);
+            slots[i] = NULL;
+        } else {
+            uint32_t y = next_rand(&seed);
+            slots[i] = b_alloc(r, y % 10 == 0 ? 4096 + (y >> 4) % (60 << 10) : 16 + (y >> 4) % 49);
+        }
+    }
+    free_slots(r, 1024);
+}
+
+static void wl_longshort(Run* r)
+{
+    const int LONG = 2000, SHORT = 8;
+    void* recent[8] = {0}; /* the short-lived ones, freed SHORT allocations later */
+    uint32_t seed = 5;
+    for (int i = 0; i < LONG; i++) {
+        slots[i] = b_alloc(r, 32 + next_rand(&seed) % 481);
+    }
+    for (int n = 0; r->ops < OPS; n++) {
+        uint32_t x = next_rand(&seed);
+        if (x % 100 == 0) {
+            int i = (x >> 8) % LONG; /* a long-lived block is replaced now and then */
+            b_free(r, slots[i]);
+            slots[i] = b_alloc(r, 32 + (x >> 4) % 481);
+        }
+        b_free(r, recent[n % SHORT]);
+        recent[n % SHORT] = b_alloc(r, 16 + (x >> 4) % 113);
+    }
+    for (int i = 0; i < SHORT; i++) {
+        b_free(r, recent[i]);
+    }
+    free_slots(r, LONG);
+}
+
+static void wl_realloc(Run* r)
+{
+    const int BUFS = 64;
+    size_t len[64] = {0};
+    uint32_t seed = 6;
+    while (r->ops < OPS) {
+        uint32_t x = next_rand(&seed);
+        int i = x % BUFS;
+        if (len[i] >= (64 << 10)) {
+            b_free(r, slots[i]); /* full, start that buffer over */
+            slots[i] = NULL;
+            len[i] = 0;
+            continue;
+        }
+        size_t want = len[i] + 16 + (x >> 8) % 241;
+        void* q = slots[i] ? b_realloc(r, slots[i], want) : b_alloc(r, want);
+        if (q) {
+            slots[i] = q;
+            len[i] = want;
+        }
+    }
+    free_slots(r, BUFS);
+}
+
+typedef struct Workload {
+    const char* name;
+    void (*run)(Run* r);
+} Workload;
+
+static const Workload workloads[] = {
+    {"churn", wl_churn},
+    {"lifo", wl_lifo},
+    {"fifo", wl_fifo},
+    {"bimodal", wl_bimodal},
+    {"longshort", wl_longshort},
+    {"realloc", wl_realloc},
+};
+
+/*
+-------------------------------------------------------------------------------
+end of workloads
+-------------------------------------------------------------------------------
+*/
+
+/* Select allocator a for the following workload runs. */
+static void use_allocator(const Allocator* a)
+{
+    if (a->policy >= 0) {
+        myalloc_policy(a->policy);
+    } else {
+        malloc_trim(0); /* give back what earlier workloads left in glibc's heap */
+    }
+}
+
+/* -f: the sampled run of workload w on allocator k, in a process of its own. */
+static int footprint_run(int w, int k)
+{
+    use_allocator(&allocators[k]);
+    Run sampled = {&allocators[k], 0, 0, 0, 1, 0, 0};
+    sampled.start = sampled.peak = allocators[k].footprint();
+    workloads[w].run(&sampled);
+    printf("%zu\n", sampled.peak - sampled.start);
+    return 0;
+}
+
+/* Run footprint_run(w, k) in a fresh copy of this program. Returns the peak in bytes, 0 if it fails. */
+static size_t fresh_footprint(size_t w, size_t k)
+{
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "/proc/%d/exe -f %zu %zu", (int)getpid(), w, k);
+    FILE* f = popen(cmd, "r");
+    size_t peak = 0;
+    if (!f || fscanf(f, "%zu", &peak) != 1) {
+        fprintf(stderr, "footprint run '%s' failed\n", cmd);
+    }
+    if (f) {
+        pclose(f);
+    }
+    return peak;
+}
+
+int main(int argc, char** argv)
+{
+    myalloc_grow(1);
+    if (argc == 4 && strcmp(argv[1], "-f") == 0) {
+        size_t w = strtoul(argv[2], NULL, 10), k = strtoul(argv[3], NULL, 10);
+        if (w < sizeof(workloads) / sizeof(workloads[0]) && k < sizeof(allocators) / sizeof(allocators[0])) {
+            return footprint_run((int)w, (int)k);
+        }
+    }
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %-11s %9s %10s %9s\n", "workload", "allocator", "ns/op", "peak KB", "failed %");
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        for (size_t k = 0; k < sizeof(allocators) / sizeof(allocators[0]); k++) {
+            const Allocator* a = &allocators[k];
+            use_allocator(a);
+
+            Run timed = {a, 0, 0, 0, 0, 0, 0};
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            workloads[w].run(&timed);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+            fflush(stdout); /* keeps our rows ahead of anything the footprint run prints to the terminal */
+            size_t peak = fresh_footprint(w, k);
+
+            printf("%-10s %-11s %9.1f %10zu %9.3f\n", workloads[w].name, a->name,
+                   elapsed * 1e9 / timed.ops, peak >> 10,
+                   timed.allocs ? 100.0 * timed.fails / timed.allocs : 0.0);
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -1,128 +1,1029 @@
 /*
 PD_Heap - myalloc nextfit implementation
+
+Three placement policies, chosen with myalloc_policy():
+
+FIT_NEXT       - the original next fit: walk every block header from last_pos.
+FIT_SEGREGATED - free blocks are also kept in doubly linked lists, one per
+                 size class, linked through their (unused) payload. A request
+                 looks at its own class first, then takes the head of the next
+                 non-empty larger class, found with bit scans over bitmaps of
+                 non-empty classes. Cost no longer depends on how many used
+                 blocks sit in the buffer.
+FIT_TLSF       - two-level segregated fit (Masmano et al.) on the same lists.
+                 The request is first rounded up to the next class boundary,
+                 so the head of whatever class the bitmaps point to fits and no
+                 list is ever walked: allocation and free are O(1) in the worst
+                 case, two bit scans and a fixed number of link updates. The
+                 price is good fit instead of first fit inside a class, a block
+                 up to 1/16 bigger than needed can be skipped.
+
+The size classes are two-level: the first level is the power of two of the
+size, the second splits that range into SL_COUNT equal steps, so a class never
+spans more than 1/16 of its sizes (below SMALL_BLOCK every 16 bytes is its own
+class). A first-level bitmap says which rows have a non-empty class, one
+second-level bitmap per row says which classes.
+
+All policies see the same lists, next fit just doesn't search them, so the
+policy can be switched at any time. Header plus payload is rounded up to 16
+bytes so every payload stays 16-byte aligned.
+
+Boundary tags: a free block repeats its size in the last 8 bytes of its payload
+(the footer), and every header has a PREV_FREE_BIT. myfree() can therefore
+find both neighbours directly - the next one is right after the payload, the
+previous one is 'footer' bytes back - and merges in constant time instead of
+walking the buffer. Used blocks don't need a footer, the flag says not to look.
+
+Arenas: the static mybuffer is the first arena. With growth on (myalloc_grow)
+a request nothing fits maps another ARENA_SIZE arena with mmap() and carves
+it into blocks the same way; every arena ends in a zero-size used header
+(the epilogue), so next_hdr() stops at the end of its own arena without
+knowing which one it is in. When myfree() leaves an mmap'd arena completely
+free it is unmapped, but only if KEEP_EMPTY other empty arenas are already
+waiting (a count, not a walk) - a workload hovering around an arena
+boundary would otherwise map and unmap on every other call.
+Requests above BIG_CUTOFF skip the arenas and get their own mapping, which
+goes straight back to the OS in myfree(); their header has BIG_BIT set.
+
+Chunk map: every mapping (arena or big block) starts on an ARENA_SIZE
+boundary, so each 1 MiB chunk of the address space belongs to at most one
+of them. A two-level table from chunk number to owner answers "which arena
+or big block is this pointer in" with two loads, so myfree(), myrealloc()
+and myalloc_usable_size() never walk a list, and a pointer that is not ours
+(or a big block already unmapped) is rejected without touching its memory.
+The arena and big block lists are only walked by print_map() and the stats.
+
+Headers are 8 bytes, the two flags live in the low bits of the size. Besides
+myalloc()/myfree() there are myalloc_aligned(), mycalloc() and myrealloc(); the
+latter grows a block into a free block right after it when it can, so no data
+is copied, and big mappings grow with mremap(), which moves pages, not bytes.
+
+Threads: myalloc_threads(1) makes the allocator safe to call from several
+threads. Each thread keeps a small cache (like glibc's tcache), one bin per
+16 bytes of payload up to TCACHE_MAX, of blocks that are used as far as the
+heap is concerned. A cache hit in myalloc() or myfree() touches no shared
+state at all; an empty bin is refilled, and an overfull one drained, by
+TCACHE_BATCH blocks per trip under heap_lock, so the lock is taken at most
+once per batch of small calls. Big mappings have their own lock, since mmap()
+is slow and has nothing to do with the lists. Arenas are published in the
+chunk map with a release store and never unmapped in this mode, which lets
+myfree() look its pointer up without the lock. fork() holds both locks
+while it copies the process, so the child never sees half-updated lists.
+
+Statistics: myalloc_stats() walks every arena and reports live and free
+bytes, the largest free block, the external fragmentation that follows from
+those (how much of the free space is not in the largest block), a histogram of
+free block sizes and the average search length, i.e. how many blocks a search
+looks at before one fits - headers for next fit, list entries for the
+segregated policies. Blocks sitting in thread caches count as used. Run the
+tests with -s file.csv to sample all of it during the timing test.
+
+Built with -DPD_HEAP_LIBRARY the tests and main() are left out, so the file
+can be linked into other programs (see PD-Heap-MyAlloc.h and, for running
+unmodified binaries on it, PD-Heap-Preload.c).
 */
 
+#define _GNU_SOURCE /* mremap */
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>   /* memset, memcpy */
+#include <sys/mman.h> /* mmap, munmap, mremap */
 #include <time.h>
+#include <unistd.h>   /* sysconf */
+
+#include "PD-Heap-MyAlloc.h"
 
 #define BUFFER_SIZE 4096
 
-static unsigned char mybuffer[BUFFER_SIZE];
+static _Alignas(16) unsigned char mybuffer[BUFFER_SIZE];
 
-/* Every block (free or used) starts with this header. */
+/*
+Every block (free or used) starts with this header. A payload size is always
+8 more than a multiple of 16 (header + payload is a multiple of 16 and the
+first header of an arena sits 8 bytes before a 16-byte boundary, so every
+payload is 16-byte aligned), which leaves the low 3 bits for the flags.
+*/
 typedef struct Header {
-    size_t size; /* number of usable payload bytes after this header */
-    int free;
+    size_t info; /* number of usable payload bytes after this header | FREE_BIT | PREV_FREE_BIT */
 } Header;
 
-#define HEADER_SIZE sizeof(Header) /* 16 bytes */
+#define HEADER_SIZE sizeof(Header) /* 8 bytes */
+#define ALIGN 16
+#define MIN_PAYLOAD 24 /* a free block has to fit its two list links and the footer */
+
+#define FREE_BIT 1      /* this block is free */
+#define PREV_FREE_BIT 2 /* the block right before this one is free, so its footer is valid */
+#define BIG_BIT 4       /* a block above BIG_CUTOFF with a mapping of its own */
+#define FLAG_BITS 7
+
+#define SIZE(h) ((h)->info & ~(size_t)FLAG_BITS)
+#define IS_FREE(h) ((h)->info & FREE_BIT)
+#define PREV_FREE(h) ((h)->info & PREV_FREE_BIT)
+#define SET_SIZE(h, s) ((h)->info = ((h)->info & FLAG_BITS) | (s))
+#define SET_FLAG(h, bit, on) ((h)->info = (on) ? (h)->info | (bit) : (h)->info & ~(size_t)(bit))
+
+/* Links of a free block, stored in its payload right after the header. */
+typedef struct FreeLinks {
+    Header* next;
+    Header* prev;
+} FreeLinks;
+
+#define LINKS(h) ((FreeLinks*)((unsigned char*)(h) + HEADER_SIZE))
+#define FOOTER(h) (*(size_t*)((unsigned char*)(h) + HEADER_SIZE + SIZE(h) - sizeof(size_t)))
+
+/* A region blocks are carved from: mybuffer, or an mmap'd mapping that starts with this struct. */
+typedef struct Arena {
+    unsigned char* base; /* first block header */
+    size_t size;         /* bytes from base to the end, epilogue included */
+    struct Arena* next;
+    struct Arena* prev;
+} Arena;
+
+/* A request above BIG_CUTOFF, alone in its own mapping: Big, padding, Header, payload. */
+typedef struct Big {
+    struct Big* next;
+    struct Big* prev;
+    size_t map_len;
+    unsigned char* payload; /* BIG_HDR + HEADER_SIZE in, or further for myalloc_aligned() */
+} Big;
+
+#define ARENA_SHIFT 20
+#define ARENA_SIZE (1 << ARENA_SHIFT) /* one mmap'd arena, 1 MiB, also the chunk map's unit */
+#define ARENA_HDR 32           /* sizeof(Arena) rounded up to ALIGN */
+#define FIRST_HDR (ALIGN - HEADER_SIZE) /* offset of an arena's first header from a 16-byte boundary */
+#define BIG_CUTOFF (128 << 10) /* bigger requests get their own mapping, like glibc's mmap threshold */
+#define BIG_HDR (32 + FIRST_HDR) /* sizeof(Big), then the header right before a 16-byte boundary */
+#define KEEP_EMPTY 1           /* completely free mmap'd arenas kept around before unmapping more */
+
+/* chunk map: 48-bit addresses, 2^28 chunks, a top table of leaves of 2^14 owners each */
+#define LEAF_BITS 14
+#define TOP_BITS (48 - ARENA_SHIFT - LEAF_BITS)
+#define BIG_TAG 1 /* owner is a Big, not an Arena (both start a mapping, so the low bit is free) */
+
+#define TCACHE_MAX 248                   /* payloads up to this size go through the thread cache */
+#define TCACHE_BINS (TCACHE_MAX / ALIGN) /* 24, 40, ... 248 */
+#define TCACHE_COUNT 32                      /* a bin holding more gives TCACHE_BATCH back */
+#define TCACHE_BATCH 16                      /* blocks moved per heap_lock round trip */
+
+/* One thread's cache. Cached blocks are chained through the first payload word. */
+typedef struct TBin {
+    Header* head;
+    int count;
+} TBin;
+
+typedef struct TCache {
+    TBin bins[TCACHE_BINS];
+    int registered; /* the exit destructor knows about this cache */
+} TCache;
+
+#define CACHE_NEXT(h) (LINKS(h)->next)
+#define CACHE_MARK(h) (LINKS(h)->prev) /* == TCACHED while in a cache, to catch double frees */
+#define TCACHED (&cached_mark)
+
+/* size classes, see the top of the file; row 0 is [0, SMALL_BLOCK), row f >= 1 is [2^(f+7), 2^(f+8)) */
+#define SL_BITS 4
+#define SL_COUNT (1 << SL_BITS)               /* classes per first-level row */
+#define SMALL_SHIFT 8
+#define SMALL_BLOCK (1 << SMALL_SHIFT)        /* ALIGN * SL_COUNT: one class per 16 bytes below this */
+#define FL_COUNT 24                           /* rows, the last one also takes everything above 2^31 */
 
 static int ready = 0;
 static Header* last_pos = NULL; /* for next fit */
+static Arena* pos_arena = NULL; /* the arena last_pos is in */
+static int policy = FIT_SEGREGATED;
+static int grow = 1;
+
+static Arena first_arena = {mybuffer + FIRST_HDR, BUFFER_SIZE - FIRST_HDR, NULL, NULL};
+static Arena* last_arena = &first_arena;
+static Big* bigs = NULL;
+static int empty_arenas = 0; /* mmap'd arenas that are one single free block */
+
+static void** chunk_map[1 << TOP_BITS]; /* leaves are mapped on first use and never unmapped */
+
+static int threads = 0;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; /* arenas, lists, last_pos */
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;  /* bigs */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static __thread TCache tcache;
+static Header cached_mark; /* only its address is used */
+
+static Header* free_lists[FL_COUNT][SL_COUNT];
+static uint32_t fl_bitmap = 0;           /* bit f set <=> row f has a non-empty class */
+static uint32_t sl_bitmap[FL_COUNT];     /* bit s set <=> free_lists[f][s] has a block */
 
-/* Return a pointer to the next block's header, or NULL if at the buffer end. */
+static unsigned long long stat_searches = 0; /* for myalloc_stats(), kept under heap_lock */
+static unsigned long long stat_probes = 0;
+
+/* Return a pointer to the next block's header, or NULL if at the end of h's arena. */
 static Header* next_hdr(Header* h)
 {
     /*  cast to (unsigned char*) to increment the Header address by 1 byte per size when using +,
         instead of stepping by the size of the Header struct which is 16 bytes. And unsigned char
         is used instead of char, because char may have issues with some large values due to sign  */
-    unsigned char* p = (unsigned char*)h + HEADER_SIZE + h->size;
-    if (p >= mybuffer + BUFFER_SIZE) {
-        return NULL;
+    Header* n = (Header*)((unsigned char*)h + HEADER_SIZE + SIZE(h));
+    if (SIZE(n) == 0) {
+        return NULL; /* the epilogue, no real block is ever 0 bytes */
     }
-    return (Header*)p;
+    return n;
 }
 
-/*
-Walk the whole buffer and merge neighbouring free blocks into one.
-Example: [free 32][free 64][used 16]  becomes  [free 96][used 16]
-*/
-static void coalesce(void)
-{
-    Header* h = (Header*)mybuffer;
-    while (h) {
-        if (h->free) {
-            Header* n;
-            /* absorb every free block that comes right after this one */
-            while ((n = next_hdr(h)) && n->free) {
-                h->size += HEADER_SIZE + n->size; /* grow h to cover n's header and size */
+/* Size class (row fl, column sl) of a payload size. */
+static void class_of(size_t size, int* fl, int* sl)
+{
+    if (size < SMALL_BLOCK) {
+        *fl = 0;
+        *sl = (int)(size / ALIGN);
+        return;
+    }
+    int msb = (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(size); /* index of the highest set bit */
+    *fl = msb - SMALL_SHIFT + 1;
+    *sl = (int)(size >> (msb - SL_BITS)) & (SL_COUNT - 1); /* the SL_BITS bits below the highest */
+    if (*fl >= FL_COUNT) {
+        *fl = FL_COUNT - 1;
+        *sl = SL_COUNT - 1;
+    }
+}
+
+/* Push a free block onto the front of its class list. */
+static void list_insert(Header* h)
+{
+    int fl, sl;
+    class_of(SIZE(h), &fl, &sl);
+    FreeLinks* l = LINKS(h);
+    l->prev = NULL;
+    l->next = free_lists[fl][sl];
+    if (l->next) {
+        LINKS(l->next)->prev = h;
+    }
+    free_lists[fl][sl] = h;
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+/* Unlink a free block from its class list (its size must not have changed since insert). */
+static void list_remove(Header* h)
+{
+    int fl, sl;
+    class_of(SIZE(h), &fl, &sl);
+    FreeLinks* l = LINKS(h);
+    if (l->prev) {
+        LINKS(l->prev)->next = l->next;
+    } else {
+        free_lists[fl][sl] = l->next;
+        if (!l->next) {
+            sl_bitmap[fl] &= ~(1u << sl);
+            if (!sl_bitmap[fl]) {
+                fl_bitmap &= ~(1u << fl);
             }
         }
-        h = next_hdr(h);
     }
+    if (l->next) {
+        LINKS(l->next)->prev = l->prev;
+    }
+}
+
+/* Head of the first non-empty class at (fl, sl) or after it, or NULL. Two bit scans. */
+static Header* first_nonempty(int fl, int sl)
+{
+    uint32_t sl_map = sl < SL_COUNT ? sl_bitmap[fl] & (~0u << sl) : 0;
+    if (!sl_map) {
+        uint32_t fl_map = fl + 1 < FL_COUNT ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctz(fl_map); /* lowest set bit = smallest larger row */
+        sl_map = sl_bitmap[fl];
+    }
+    return free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+/* Header of the block before h. Only valid while PREV_FREE(h) is set. */
+static Header* prev_hdr(Header* h)
+{
+    size_t prev_size = *(size_t*)((unsigned char*)h - sizeof(size_t)); /* the previous block's footer */
+    return (Header*)((unsigned char*)h - prev_size - HEADER_SIZE);
 }
 
-/* Set up the buffer as one big free block. Called automatically on first use. */
+/*
+Tell the block after h whether h is free. In thread mode n can be a used block
+whose owner reads its header without the lock, hence the single atomic store.
+*/
+static void set_next_prev_free(Header* h, int free)
+{
+    Header* n = next_hdr(h);
+    if (n) {
+        size_t info = free ? n->info | PREV_FREE_BIT : n->info & ~(size_t)PREV_FREE_BIT;
+        __atomic_store_n(&n->info, info, __ATOMIC_RELAXED);
+    }
+}
+
+/* Turn a whole arena into one free block followed by the epilogue. */
+static Header* format_arena(Arena* a)
+{
+    Header* end = (Header*)(a->base + a->size - HEADER_SIZE);
+    end->info = 0; /* size 0, used */
+
+    Header* h = (Header*)a->base;
+    h->info = (a->size - 2 * HEADER_SIZE) | FREE_BIT; /* nothing before the first block */
+    FOOTER(h) = SIZE(h);
+    list_insert(h);
+    return h;
+}
+
+/* Set up mybuffer as one big free block. Called automatically on first use. */
 static void init(void)
 {
-    Header* h = (Header*)mybuffer;
-    h->size = BUFFER_SIZE - HEADER_SIZE;
-    h->free = 1;
-    last_pos = h;
+    for (int f = 0; f < FL_COUNT; f++) {
+        for (int c = 0; c < SL_COUNT; c++) {
+            free_lists[f][c] = NULL;
+        }
+        sl_bitmap[f] = 0;
+    }
+    fl_bitmap = 0;
+
+    first_arena.base = mybuffer + FIRST_HDR;
+    first_arena.size = BUFFER_SIZE - FIRST_HDR;
+    first_arena.next = NULL;
+    first_arena.prev = NULL;
+    last_arena = &first_arena;
+
+    last_pos = format_arena(&first_arena);
+    pos_arena = &first_arena;
+    stat_searches = 0;
+    stat_probes = 0;
     ready = 1;
 }
 
+/* The arena or (tagged with BIG_TAG) big block whose mapping has p's chunk, or NULL. Takes no lock. */
+static void* chunk_owner(const void* p)
+{
+    uintptr_t c = (uintptr_t)p >> ARENA_SHIFT;
+    if (c >> (TOP_BITS + LEAF_BITS)) {
+        return NULL;
+    }
+    void** leaf = __atomic_load_n(&chunk_map[c >> LEAF_BITS], __ATOMIC_ACQUIRE);
+    return leaf ? __atomic_load_n(&leaf[c & ((1 << LEAF_BITS) - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
+
 /*
--------------------------------------------------------------------------------
-end of inaccessible static functions
--------------------------------------------------------------------------------
-start of myalloc and myfree
--------------------------------------------------------------------------------
+Make owner (NULL to clear) the owner of every chunk of the mapping at m, len bytes long.
+Called under heap_lock for arenas and big_lock for big blocks, so two callers may need
+the same new leaf at once; whoever installs it first wins. Returns -1 if a leaf can't be mapped.
 */
+static int chunk_set(unsigned char* m, size_t len, void* owner)
+{
+    uintptr_t last = ((uintptr_t)m + len - 1) >> ARENA_SHIFT;
+    for (uintptr_t c = (uintptr_t)m >> ARENA_SHIFT; c <= last; c++) {
+        void*** top = &chunk_map[c >> LEAF_BITS];
+        void** leaf = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+        if (!leaf) {
+            if (!owner) {
+                continue;
+            }
+            void** fresh = mmap(NULL, sizeof(void*) << LEAF_BITS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (fresh == MAP_FAILED) {
+                return -1;
+            }
+            if (__atomic_compare_exchange_n(top, &leaf, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                leaf = fresh;
+            } else {
+                munmap(fresh, sizeof(void*) << LEAF_BITS); /* leaf now holds the other one */
+            }
+        }
+        __atomic_store_n(&leaf[c & ((1 << LEAF_BITS) - 1)], owner, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
 
 /*
-Allocate 'size' bytes and return a pointer to the usable memory.
-Returns NULL if size is 0 or there is not enough space.
-
-Next Fit: start searching from last_pos, wrap around once if needed,
-give up only after a full lap with no suitable block found.
+mmap() len bytes starting on an ARENA_SIZE boundary. First try the aligned spot
+right below the previous one, which is usually still free, so it takes one
+call; otherwise map a chunk more than needed and cut off both ends.
 */
-void* myalloc(size_t size)
+static unsigned char* map_aligned(size_t len)
 {
-    if (size == 0) {
+    static unsigned char* hint = NULL; /* only a hint, a race on it costs a retry at most */
+    unsigned char* want = __atomic_load_n(&hint, __ATOMIC_RELAXED);
+    if (want) {
+        /* the kernel hands out addresses top down, so the free space is below the last mapping */
+        want = (unsigned char*)(((uintptr_t)want - len) & ~(uintptr_t)(ARENA_SIZE - 1));
+    }
+    unsigned char* m = want ? mmap(want, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+    if (m != MAP_FAILED && ((uintptr_t)m & (ARENA_SIZE - 1))) {
+        munmap(m, len);
+        m = MAP_FAILED;
+    }
+    if (m == MAP_FAILED) {
+        m = mmap(NULL, len + ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+            return NULL;
+        }
+        unsigned char* start = (unsigned char*)(((uintptr_t)m + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1));
+        if (start > m) {
+            munmap(m, start - m);
+        }
+        munmap(start + len, m + ARENA_SIZE - start);
+        m = start;
+    }
+    __atomic_store_n(&hint, m, __ATOMIC_RELAXED);
+    return m;
+}
+
+/* Map one more arena and append it to the list. Returns its free block, or NULL if mmap fails. */
+static Header* add_arena(void)
+{
+    unsigned char* m = map_aligned(ARENA_SIZE);
+    if (!m) {
         return NULL;
     }
-    if (!ready) {
-        init();
+    Arena* a = (Arena*)m;
+    a->base = m + ARENA_HDR + FIRST_HDR;
+    a->size = ARENA_SIZE - ARENA_HDR - FIRST_HDR;
+    a->next = NULL;
+    a->prev = last_arena;
+    if (chunk_set(m, ARENA_SIZE, a) != 0) { /* a is complete before anyone sees it */
+        munmap(m, ARENA_SIZE);
+        return NULL;
+    }
+    last_arena->next = a;
+    last_arena = a;
+    empty_arenas++; /* until heap_alloc() takes from it, right away */
+    return format_arena(a);
+}
+
+/* Unmap an arena whose only block is the free block h. */
+static void drop_arena(Arena* a, Header* h)
+{
+    list_remove(h);
+    if (pos_arena == a) {
+        last_pos = (Header*)first_arena.base; /* any valid header will do */
+        pos_arena = &first_arena;
     }
+    a->prev->next = a->next; /* never the first arena, so prev exists */
+    if (a->next) {
+        a->next->prev = a->prev;
+    } else {
+        last_arena = a->prev;
+    }
+    chunk_set((unsigned char*)a, ARENA_SIZE, NULL);
+    munmap(a, ARENA_SIZE);
+}
+
+/* The arena whose payload area contains p at a spot a payload can start, or NULL. */
+static Arena* arena_of(unsigned char* p)
+{
+    Arena* a = &first_arena;
+    if (p < mybuffer || p >= mybuffer + BUFFER_SIZE) {
+        a = chunk_owner(p);
+        if (!a || ((uintptr_t)a & BIG_TAG)) {
+            return NULL;
+        }
+    }
+    if (p >= a->base + HEADER_SIZE && p < a->base + a->size - HEADER_SIZE) {
+        return (uintptr_t)p % ALIGN == 0 ? a : NULL; /* every payload is 16-byte aligned */
+    }
+    return NULL;
+}
 
+/* The mmap'd arena that free block h (the last one in its arena) makes up on its own, or NULL. */
+static Arena* whole_arena(Header* h)
+{
+    Arena* a = arena_of((unsigned char*)h + HEADER_SIZE);
+    return a && a != &first_arena && h == (Header*)a->base ? a : NULL;
+}
+
+/* Give a request above BIG_CUTOFF a mapping of its own, payload aligned to 'align' (a power of two). */
+static void* big_alloc(size_t size, size_t align)
+{
+    size_t skip = align > ALIGN ? align : 0; /* room to slide the payload up to the next 'align' boundary */
+    size_t len = (BIG_HDR + HEADER_SIZE + skip + size + 4095) & ~(size_t)4095;
+    unsigned char* m = map_aligned(len);
+    if (!m) {
+        return NULL;
+    }
+    Big* b = (Big*)m;
+    if (chunk_set(m, len, (unsigned char*)b + BIG_TAG) != 0) {
+        munmap(m, len);
+        return NULL;
+    }
+    b->map_len = len;
+    b->prev = NULL;
+    b->next = bigs;
+    if (bigs) {
+        bigs->prev = b;
+    }
+    bigs = b;
+
+    unsigned char* p = m + BIG_HDR + HEADER_SIZE;
+    if (skip) {
+        p = (unsigned char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    }
+    b->payload = p;
+    Header* h = (Header*)(p - HEADER_SIZE);
+    h->info = ((size_t)(m + len - p) & ~(size_t)FLAG_BITS) | BIG_BIT; /* used, no neighbours */
+    return p;
+}
+
+/* The big block with payload p, or NULL if p is not one (or was already freed). */
+static Big* big_find(unsigned char* p)
+{
+    uintptr_t o = (uintptr_t)chunk_owner(p);
+    if (!(o & BIG_TAG)) {
+        return NULL;
+    }
+    Big* b = (Big*)(o - BIG_TAG);
+    if (b->payload != p || !(((Header*)(p - HEADER_SIZE))->info & BIG_BIT)) {
+        return NULL; /* somewhere else in that mapping */
+    }
+    return b;
+}
+
+/* Unmap the big block with payload p. Returns -1 if p is not one (or was already freed). */
+static int big_free(unsigned char* p)
+{
+    Big* b = big_find(p);
+    if (!b) {
+        return -1;
+    }
+    if (b->prev) {
+        b->prev->next = b->next;
+    } else {
+        bigs = b->next;
+    }
+    if (b->next) {
+        b->next->prev = b->prev;
+    }
+    chunk_set((unsigned char*)b, b->map_len, NULL);
+    munmap(b, b->map_len);
+    return 0;
+}
+
+/*
+Make big block b hold at least 'size' bytes. The mapping grows in place if the
+address space after it is free, otherwise mremap() moves its pages onto a new
+aligned mapping; either way nothing is copied. Returns the payload, NULL if it fails.
+*/
+static void* big_grow(Big* b, size_t size)
+{
+    size_t off = (size_t)(b->payload - (unsigned char*)b);
+    if (size <= b->map_len - off) {
+        return b->payload;
+    }
+    size_t len = (off + size + 4095) & ~(size_t)4095;
+    size_t old_len = b->map_len; /* b is gone once the pages move */
+    Big* nb = mremap(b, old_len, len, 0);
+    if (nb != MAP_FAILED) {
+        if (chunk_set((unsigned char*)nb, len, (unsigned char*)nb + BIG_TAG) != 0) {
+            mremap(nb, len, old_len, 0); /* back to the size its chunks are registered for */
+            return NULL;
+        }
+    } else {
+        /*  register the new place first: until the pages arrive a lookup there finds a
+            zero payload pointer and matches nothing */
+        unsigned char* to = map_aligned(len);
+        if (!to) {
+            return NULL;
+        }
+        if (chunk_set(to, len, to + BIG_TAG) == 0) {
+            nb = mremap(b, old_len, len, MREMAP_MAYMOVE | MREMAP_FIXED, to);
+        }
+        if (nb == MAP_FAILED) {
+            chunk_set(to, len, NULL);
+            munmap(to, len);
+            return NULL;
+        }
+        chunk_set((unsigned char*)b, old_len, NULL); /* to was mapped next to b, they share no chunk */
+    }
+    nb->map_len = len;
+    nb->payload = (unsigned char*)nb + off; /* same offset, mappings are page aligned */
+    if (nb->prev) {
+        nb->prev->next = nb;
+    } else {
+        bigs = nb;
+    }
+    if (nb->next) {
+        nb->next->prev = nb;
+    }
+    Header* h = (Header*)(nb->payload - HEADER_SIZE);
+    h->info = ((len - off) & ~(size_t)FLAG_BITS) | BIG_BIT;
+    return nb->payload;
+}
+
+/*
+Turn free block h (already off its list) into a used block of 'size' bytes.
+Split off the tail as a new free block if the leftover is large enough to be useful later.
+*/
+static void take(Header* h, size_t size)
+{
+    if (SIZE(h) >= size + HEADER_SIZE + MIN_PAYLOAD) {
+        Header* rest = (Header*)((unsigned char*)h + HEADER_SIZE + size);
+        rest->info = (SIZE(h) - size - HEADER_SIZE) | FREE_BIT; /* h is about to be used */
+        FOOTER(rest) = SIZE(rest);
+        list_insert(rest);
+        SET_SIZE(h, size); /* the block after rest still sees a free block before it */
+    } else {
+        set_next_prev_free(h, 0);
+    }
+    SET_FLAG(h, FREE_BIT, 0);
+}
+
+/*
+Next fit: start searching from last_pos, continue through the following arenas,
+wrap around to mybuffer once, give up after a full lap.
+*/
+static Header* find_next_fit(size_t size)
+{
     Header* start = last_pos;
     Header* h = start;
+    Arena* a = pos_arena;
     int wrapped = 0;
+    unsigned long long probes = 0;
 
     while (1) {
-        if (h->free && h->size >= size) {
-            /*  split the block if the leftover is large enough to be useful later. 
-                8 is the minimal amount of space that can be reserved ( because of padding) */
-            if (h->size >= size + HEADER_SIZE + 8) {
-                Header* rest = (Header*)((unsigned char*)h + HEADER_SIZE + size);
-                rest->size = h->size - size - HEADER_SIZE;
-                rest->free = 1;
-                h->size = size;
-            }
-            h->free = 0;
+        probes++;
+        if (IS_FREE(h) && SIZE(h) >= size) {
             last_pos = h; /* remember this spot for the next call */
-            return (unsigned char*)h + HEADER_SIZE; /* return pointer past the header */
+            pos_arena = a;
+            stat_probes += probes;
+            return h;
         }
 
         Header* next = next_hdr(h);
         if (!next) {
-            if (wrapped) {
-                return NULL; /* already looped once, nothing fits anywhere */
+            a = a->next; /* end of this arena, go on with the next one */
+            if (!a) {
+                if (wrapped) {
+                    stat_probes += probes;
+                    return NULL; /* already looped once, nothing fits anywhere */
+                }
+                wrapped = 1;
+                a = &first_arena; /* wrap around to the start */
             }
-            wrapped = 1;
-            h = (Header*)mybuffer; /* wrap around to the start */
+            h = (Header*)a->base;
         } else {
             h = next;
         }
 
         if (h == start && wrapped) {
+            stat_probes += probes;
             return NULL; /* back where we started, full lap completed */
         }
     }
 }
 
+/*
+Segregated fit: first fit inside the request's own class (blocks there may be
+smaller than the request), otherwise the head of the next non-empty class,
+where every block is above the request's class and therefore fits.
+*/
+static Header* find_segregated(size_t size)
+{
+    int fl, sl;
+    class_of(size, &fl, &sl);
+    for (Header* h = free_lists[fl][sl]; h; h = LINKS(h)->next) {
+        stat_probes++;
+        if (SIZE(h) >= size) {
+            return h;
+        }
+    }
+    Header* h = first_nonempty(fl, sl + 1);
+    stat_probes += h != NULL;
+    return h;
+}
+
+/*
+TLSF: round the size up to the first size of the next class (classes of
+16-byte steps need no rounding), then any block in that class or above fits.
+Only the clamped last class can hold smaller blocks, so only there is a list walked.
+*/
+static Header* find_tlsf(size_t size)
+{
+    size_t target = size;
+    if (size >= SMALL_BLOCK) {
+        int msb = (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(size);
+        target += ((size_t)1 << (msb - SL_BITS)) - 1;
+    }
+    int fl, sl;
+    class_of(target, &fl, &sl);
+    Header* h = first_nonempty(fl, sl);
+    stat_probes += h != NULL;
+    while (h && SIZE(h) < size) {
+        h = LINKS(h)->next;
+        stat_probes += h != NULL;
+    }
+    return h;
+}
+
+/* Round a request up to a block payload size. */
+static size_t block_size(size_t size)
+{
+    /* header + payload a multiple of 16 keeps the next payload aligned */
+    size = ((size + HEADER_SIZE + ALIGN - 1) & ~(size_t)(ALIGN - 1)) - HEADER_SIZE;
+    if (size < MIN_PAYLOAD) {
+        size = MIN_PAYLOAD; /* it has to be able to turn back into a free block */
+    }
+    return size;
+}
+
+/* Find (or map) a block for a rounded size and mark it used. Holds heap_lock in thread mode. */
+static Header* heap_alloc(size_t size)
+{
+    if (!ready) {
+        init();
+    }
+    stat_searches++;
+    Header* h = policy == FIT_NEXT ? find_next_fit(size)
+              : policy == FIT_TLSF ? find_tlsf(size) : find_segregated(size);
+    if (!h) {
+        if (!grow || !(h = add_arena())) {
+            return NULL;
+        }
+        if (policy == FIT_NEXT) {
+            last_pos = h; /* continue from the new arena, like a hit there */
+            pos_arena = last_arena;
+        }
+    }
+    if (!next_hdr(h) && whole_arena(h)) {
+        empty_arenas--; /* last block of its arena and the first too: the arena was empty */
+    }
+    list_remove(h);
+    take(h, size);
+    return h;
+}
+
+/*
+Give used block h back to the heap. With may_unmap set, an mmap'd arena that
+ends up completely free may be unmapped. Holds heap_lock in thread mode.
+*/
+static void heap_free(Header* h, int may_unmap)
+{
+    /*  mark it first: if h gets absorbed below, its header stays behind inside the merged
+        payload still saying free, so an immediate second myfree(ptr) is still caught */
+    SET_FLAG(h, FREE_BIT, 1);
+
+    /* merge with adjacent free blocks straight away, only the two neighbours can be free */
+    Header* n = next_hdr(h);
+    if (n && IS_FREE(n)) {
+        list_remove(n);
+        if (last_pos == n) {
+            last_pos = h; /* n's header is now just bytes inside h's payload */
+        }
+        SET_SIZE(h, SIZE(h) + HEADER_SIZE + SIZE(n)); /* grow h to cover n's header and size */
+    }
+    if (PREV_FREE(h)) {
+        Header* prev = prev_hdr(h);
+        list_remove(prev); /* its size is about to change, so it changes class too */
+        if (last_pos == h) {
+            last_pos = prev;
+        }
+        SET_SIZE(prev, SIZE(prev) + HEADER_SIZE + SIZE(h));
+        h = prev;
+    }
+
+    FOOTER(h) = SIZE(h);
+    set_next_prev_free(h, 1);
+    list_insert(h);
+
+    /* a whole mmap'd arena free again: unmap it unless fewer than KEEP_EMPTY others are waiting */
+    Arena* a;
+    if (!next_hdr(h) && (a = whole_arena(h))) {
+        if (may_unmap && empty_arenas >= KEEP_EMPTY) {
+            drop_arena(a, h);
+        } else {
+            empty_arenas++;
+        }
+    }
+}
+
+/* fork() handlers: keep the lists consistent for the child. */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&heap_lock);
+    pthread_mutex_lock(&big_lock);
+}
+
+static void fork_done(void)
+{
+    pthread_mutex_unlock(&big_lock);
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void fork_init(void)
+{
+    pthread_atfork(fork_prepare, fork_done, fork_done);
+}
+
+/* Take heap_lock if the allocator is in thread mode. */
+static void lock_heap(void)
+{
+    if (threads) {
+        pthread_mutex_lock(&heap_lock);
+    }
+}
+
+static void unlock_heap(void)
+{
+    if (threads) {
+        pthread_mutex_unlock(&heap_lock);
+    }
+}
+
+/* Shrink used block h to a rounded payload size, the tail goes back to the heap if it can be a block. */
+static void trim(Header* h, size_t size)
+{
+    if (SIZE(h) < size + HEADER_SIZE + MIN_PAYLOAD) {
+        return;
+    }
+    Header* rest = (Header*)((unsigned char*)h + HEADER_SIZE + size);
+    rest->info = SIZE(h) - size - HEADER_SIZE; /* used for a moment, so heap_free() can take it */
+    SET_SIZE(h, size);
+    heap_free(rest, 0); /* merges with a free block after it */
+}
+
+/* Give blocks from the front of a bin back to the heap until 'keep' are left. */
+static void tcache_drain(TBin* b, int keep)
+{
+    pthread_mutex_lock(&heap_lock);
+    while (b->count > keep) {
+        Header* h = b->head;
+        b->head = CACHE_NEXT(h);
+        b->count--;
+        heap_free(h, 0);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/* pthread key destructor: an exiting thread hands its whole cache back. */
+static void tcache_exit(void* arg)
+{
+    TCache* c = arg;
+    for (int i = 0; i < TCACHE_BINS; i++) {
+        if (c->bins[i].count) {
+            tcache_drain(&c->bins[i], 0);
+        }
+    }
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/* First cache use in this thread: make sure the cache is emptied when the thread exits. */
+static void tcache_register(void)
+{
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
+}
+
+/* myalloc() for a rounded size <= TCACHE_MAX in thread mode. */
+static void* tcache_alloc(size_t size)
+{
+    TBin* b = &tcache.bins[size / ALIGN - 1];
+    if (!b->head) {
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        /* empty: fetch a whole batch of this size while holding the lock once */
+        pthread_mutex_lock(&heap_lock);
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            Header* h = heap_alloc(size);
+            if (!h) {
+                break;
+            }
+            CACHE_NEXT(h) = b->head;
+            b->head = h;
+            b->count++;
+        }
+        pthread_mutex_unlock(&heap_lock);
+        if (!b->head) {
+            return NULL;
+        }
+    }
+    Header* h = b->head;
+    b->head = CACHE_NEXT(h);
+    b->count--;
+    CACHE_MARK(h) = NULL;
+    return (unsigned char*)h + HEADER_SIZE;
+}
+
+/*
+myfree() of a used block with payload <= TCACHE_MAX in thread mode.
+The block may come from any thread, it simply joins this thread's cache.
+*/
+static int tcache_free(Header* h, size_t size)
+{
+    TBin* b = &tcache.bins[size / ALIGN - 1];
+    if (CACHE_MARK(h) == TCACHED) {
+        /* probably a double free, the mark can also be leftover user data, so make sure */
+        for (Header* c = b->head; c; c = CACHE_NEXT(c)) {
+            if (c == h) {
+                return -1;
+            }
+        }
+    }
+    if (!tcache.registered) {
+        tcache_register();
+    }
+    CACHE_NEXT(h) = b->head;
+    CACHE_MARK(h) = TCACHED;
+    b->head = h;
+    if (++b->count > TCACHE_COUNT) {
+        tcache_drain(b, TCACHE_COUNT - TCACHE_BATCH);
+    }
+    return 0;
+}
+
+/*
+-------------------------------------------------------------------------------
+end of inaccessible static functions
+-------------------------------------------------------------------------------
+start of myalloc and myfree
+-------------------------------------------------------------------------------
+*/
+
+/*
+Choose the placement policy (FIT_NEXT, FIT_SEGREGATED or FIT_TLSF) for the following calls.
+Returns the previous one.
+*/
+int myalloc_policy(int fit)
+{
+    int old = policy;
+    policy = fit;
+    return old;
+}
+
+/*
+Turn growth past mybuffer on (1, the default) or off (0) for the following calls.
+With it off myalloc() never maps anything, as if mybuffer was all there is.
+Returns the previous setting.
+*/
+int myalloc_grow(int on)
+{
+    int old = grow;
+    grow = on;
+    return old;
+}
+
+/*
+Turn thread-safe mode on (1) or off (0), see the top of the file. Like the
+other settings it may only be changed while a single thread uses the
+allocator; turning it off returns the calling thread's cache to the heap.
+Returns the previous setting.
+*/
+int myalloc_threads(int on)
+{
+    int old = threads;
+    if (threads && !on) {
+        tcache_exit(&tcache);
+    }
+    threads = on;
+    if (on) {
+        pthread_once(&fork_once, fork_init); /* may allocate, so only once threads is set */
+    }
+    return old;
+}
+
+/*
+Allocate 'size' bytes and return a pointer to the usable memory.
+Returns NULL if size is 0 or there is not enough space.
+*/
+void* myalloc(size_t size)
+{
+    if (size == 0 || size > (grow ? SIZE_MAX / 2 : BUFFER_SIZE)) {
+        return NULL;
+    }
+    if (grow && size > BIG_CUTOFF) {
+        if (!threads) {
+            return big_alloc(size, ALIGN);
+        }
+        pthread_mutex_lock(&big_lock);
+        void* p = big_alloc(size, ALIGN);
+        pthread_mutex_unlock(&big_lock);
+        return p;
+    }
+
+    size = block_size(size);
+    Header* h;
+    if (!threads) {
+        h = heap_alloc(size);
+    } else if (size <= TCACHE_MAX) {
+        return tcache_alloc(size);
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        h = heap_alloc(size);
+        pthread_mutex_unlock(&heap_lock);
+    }
+    if (!h) {
+        return NULL;
+    }
+    return (unsigned char*)h + HEADER_SIZE; /* return pointer past the header */
+}
+
 /*
 Release a previously allocated block.
 Returns 0 on success, otherwise -1.
@@ -136,22 +1037,251 @@ int myfree(void* ptr)
     /* cast for 1 byte arithmetic operations */
     unsigned char* p = (unsigned char*)ptr;
 
-    /* make sure the pointer is actually inside our buffer. */
-    if (p < mybuffer + HEADER_SIZE || p >= mybuffer + BUFFER_SIZE) {
-        return -1;
+    /* make sure the pointer is actually inside one of our arenas, at a spot a payload can start */
+    Arena* a = arena_of(p);
+    if (!a) {
+        /* not in an arena, maybe it has a mapping of its own */
+        if (!threads) {
+            return big_free(p);
+        }
+        pthread_mutex_lock(&big_lock);
+        int r = big_free(p);
+        pthread_mutex_unlock(&big_lock);
+        return r;
     }
 
     Header* h = (Header*)(p - HEADER_SIZE); /* step back to find the header */
 
-    if (h->free) {
+    /* one load: in thread mode a neighbour may be flipping PREV_FREE_BIT under heap_lock */
+    size_t info = __atomic_load_n(&h->info, __ATOMIC_RELAXED);
+    if (info & FREE_BIT) {
         return -1; /* already free, double free detected */
     }
 
-    h->free = 1;
-    coalesce(); /* merge with adjacent free blocks straight away */
+    if (!threads) {
+        heap_free(h, 1);
+    } else if ((info & ~(size_t)FLAG_BITS) <= TCACHE_MAX) {
+        return tcache_free(h, info & ~(size_t)FLAG_BITS);
+    } else {
+        pthread_mutex_lock(&heap_lock);
+        heap_free(h, 0); /* arenas stay mapped in thread mode */
+        pthread_mutex_unlock(&heap_lock);
+    }
     return 0;
 }
 
+/*
+Allocate 'size' bytes at an address that is a multiple of 'align' (a power of two).
+Returns NULL if align is not a power of two, size is 0 or there is not enough space.
+The block is released with myfree() like any other.
+*/
+void* myalloc_aligned(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        return NULL;
+    }
+    if (align <= ALIGN) {
+        return myalloc(size); /* every payload is 16-byte aligned anyway */
+    }
+    size_t limit = grow ? SIZE_MAX / 4 : BUFFER_SIZE;
+    if (size == 0 || size > limit || align > limit) {
+        return NULL;
+    }
+    if (grow && size > BIG_CUTOFF) {
+        if (threads) {
+            pthread_mutex_lock(&big_lock);
+        }
+        void* p = big_alloc(size, align);
+        if (threads) {
+            pthread_mutex_unlock(&big_lock);
+        }
+        return p;
+    }
+
+    size = block_size(size);
+    lock_heap();
+    /*  take enough that an aligned payload, with room for a free block in front of it, always
+        fits; then give the front and the tail back (they are merged with their free neighbours) */
+    Header* h = heap_alloc(size + align + HEADER_SIZE + MIN_PAYLOAD);
+    if (h) {
+        unsigned char* p = (unsigned char*)h + HEADER_SIZE;
+        unsigned char* q = (unsigned char*)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+        if (q != p) {
+            if ((size_t)(q - p) < HEADER_SIZE + MIN_PAYLOAD) {
+                q += align; /* the gap is too small to be a block of its own */
+            }
+            Header* nh = (Header*)(q - HEADER_SIZE);
+            nh->info = SIZE(h) - (size_t)(q - p); /* used, heap_free() below sets its PREV_FREE_BIT */
+            SET_SIZE(h, (size_t)(q - p) - HEADER_SIZE);
+            heap_free(h, 0);
+            h = nh;
+        }
+        trim(h, size);
+    }
+    unlock_heap();
+    return h ? (unsigned char*)h + HEADER_SIZE : NULL;
+}
+
+/*
+Allocate room for n elements of 'size' bytes, all zero.
+Returns NULL if n * size overflows, is 0 or there is not enough space.
+*/
+void* mycalloc(size_t n, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        return NULL;
+    }
+    void* p = myalloc(total);
+    if (p && !(grow && total > BIG_CUTOFF)) {
+        memset(p, 0, total); /* a fresh big mapping is zero already */
+    }
+    return p;
+}
+
+/*
+Resize the block at ptr to 'size' bytes, keeping its contents.
+A block shrinks in place, and grows in place when the block right after it is
+free and big enough; only otherwise it moves (new block, copy, free the old one).
+myrealloc(NULL, size) is myalloc(size), myrealloc(ptr, 0) frees ptr and returns NULL.
+Returns NULL if there is not enough space or ptr is not a live block; ptr stays valid then.
+*/
+void* myrealloc(void* ptr, size_t size)
+{
+    if (!ptr) {
+        return myalloc(size);
+    }
+    if (size == 0) {
+        myfree(ptr);
+        return NULL;
+    }
+    if (size > (grow ? SIZE_MAX / 2 : BUFFER_SIZE)) {
+        return NULL;
+    }
+
+    unsigned char* p = (unsigned char*)ptr;
+    Arena* a = arena_of(p);
+    if (!a) {
+        if (threads) {
+            pthread_mutex_lock(&big_lock);
+        }
+        Big* b = big_find(p);
+        void* q = b ? big_grow(b, size) : NULL;
+        if (threads) {
+            pthread_mutex_unlock(&big_lock);
+        }
+        return q;
+    }
+
+    Header* h = (Header*)(p - HEADER_SIZE);
+    if (__atomic_load_n(&h->info, __ATOMIC_RELAXED) & FREE_BIT) {
+        return NULL;
+    }
+
+    size_t need = block_size(size);
+    int in_place = 0;
+    lock_heap();
+    if (need <= SIZE(h)) {
+        trim(h, need);
+        in_place = 1;
+    } else {
+        Header* n = next_hdr(h);
+        if (n && IS_FREE(n) && SIZE(h) + HEADER_SIZE + SIZE(n) >= need) {
+            list_remove(n);
+            if (last_pos == n) {
+                last_pos = h; /* n's header is now just bytes inside h's payload */
+            }
+            SET_SIZE(h, SIZE(h) + HEADER_SIZE + SIZE(n));
+            set_next_prev_free(h, 0);
+            trim(h, need);
+            in_place = 1;
+        }
+    }
+    size_t old = SIZE(h);
+    unlock_heap();
+    if (in_place) {
+        return ptr;
+    }
+
+    void* q = myalloc(size);
+    if (!q) {
+        return NULL;
+    }
+    memcpy(q, ptr, old < size ? old : size);
+    myfree(ptr);
+    return q;
+}
+
+/* Payload bytes usable at ptr (at least what was asked for), 0 if ptr is not a live block. */
+size_t myalloc_usable_size(void* ptr)
+{
+    if (!ptr) {
+        return 0;
+    }
+    unsigned char* p = (unsigned char*)ptr;
+    if (arena_of(p)) {
+        size_t info = __atomic_load_n(&((Header*)(p - HEADER_SIZE))->info, __ATOMIC_RELAXED);
+        return info & FREE_BIT ? 0 : info & ~(size_t)FLAG_BITS;
+    }
+    if (threads) {
+        pthread_mutex_lock(&big_lock);
+    }
+    Big* b = big_find(p);
+    size_t n = b ? SIZE((Header*)(p - HEADER_SIZE)) : 0;
+    if (threads) {
+        pthread_mutex_unlock(&big_lock);
+    }
+    return n;
+}
+
+/* Fill in a snapshot of the heap, see MyAllocStats in PD-Heap-MyAlloc.h. Walks every block. */
+void myalloc_stats(MyAllocStats* s)
+{
+    memset(s, 0, sizeof(*s));
+    lock_heap();
+    if (!ready) {
+        init();
+    }
+    for (Arena* a = &first_arena; a; a = a->next) {
+        size_t span = 0; /* the free block at the end of an arena (or all of it) is not needed */
+        for (Header* h = (Header*)a->base; h; h = next_hdr(h)) {
+            size_t size = SIZE(h);
+            if (!IS_FREE(h)) {
+                s->live_bytes += size;
+                s->used_blocks++;
+                span = (size_t)((unsigned char*)h - a->base) + HEADER_SIZE + size;
+                continue;
+            }
+            s->free_bytes += size;
+            s->free_blocks++;
+            if (size > s->largest_free) {
+                s->largest_free = size;
+            }
+            int bucket = (int)(sizeof(size_t) * 8 - 1) - __builtin_clzl(size) - 4; /* MIN_PAYLOAD lands in 0 */
+            s->free_hist[bucket < MYALLOC_HIST ? bucket : MYALLOC_HIST - 1]++;
+        }
+        s->span_bytes += span;
+    }
+    s->searches = stat_searches;
+    s->probes = stat_probes;
+    unlock_heap();
+
+    if (threads) {
+        pthread_mutex_lock(&big_lock);
+    }
+    for (Big* b = bigs; b; b = b->next) {
+        s->live_bytes += SIZE((Header*)(b->payload - HEADER_SIZE));
+        s->span_bytes += b->map_len;
+        s->used_blocks++;
+    }
+    if (threads) {
+        pthread_mutex_unlock(&big_lock);
+    }
+
+    s->fragmentation = s->free_bytes ? 1.0 - (double)s->largest_free / s->free_bytes : 0.0;
+    s->avg_search = s->searches ? (double)s->probes / s->searches : 0.0;
+}
+
 /*
 -------------------------------------------------------------------------------
 end of main functions
@@ -160,21 +1290,49 @@ start of testing helper functions
 -------------------------------------------------------------------------------
 */
 
-/* visualize the buffer and it's segments */
+/* visualize the arenas and their segments, offsets are from each arena's start */
 void print_map(void)
 {
-    printf("  %-8s %-8s %s\n", "offset", "size", "status");
-    for (Header* h = (Header*)mybuffer; h; h = next_hdr(h)) {
-        printf("  %-8d %-8zu %s\n",
-               (int)((unsigned char*)h - mybuffer),
-               h->size,
-               h->free ? "free" : "USED");
+    int n = 0;
+    for (Arena* a = &first_arena; a; a = a->next) {
+        printf("  arena %d (%s, %zu bytes)\n", n++, a == &first_arena ? "mybuffer" : "mmap", a->size);
+        printf("  %-8s %-8s %s\n", "offset", "size", "status");
+        for (Header* h = (Header*)a->base; h; h = next_hdr(h)) {
+            printf("  %-8d %-8zu %s\n",
+                   (int)((unsigned char*)h - a->base),
+                   SIZE(h),
+                   IS_FREE(h) ? "free" : "USED");
+        }
+    }
+    for (Big* b = bigs; b; b = b->next) {
+        printf("  big mapping, %zu bytes\n", SIZE((Header*)(b->payload - HEADER_SIZE)));
     }
     printf("\n");
 }
 
+#ifndef PD_HEAP_LIBRARY
+
+/* Unmap every arena but mybuffer and every big block, for a fresh start. */
+static void release_all(void)
+{
+    while (last_arena != &first_arena) {
+        Arena* a = last_arena;
+        last_arena = a->prev;
+        chunk_set((unsigned char*)a, ARENA_SIZE, NULL);
+        munmap(a, ARENA_SIZE);
+    }
+    first_arena.next = NULL;
+    empty_arenas = 0;
+    while (bigs) {
+        Big* b = bigs;
+        bigs = b->next;
+        chunk_set((unsigned char*)b, b->map_len, NULL);
+        munmap(b, b->map_len);
+    }
+}
+
 #define CHECK(cond, msg) printf("  %s %s\n", (cond) ? "[PASS]" : "[FAIL]", msg)
-#define RESET() do { ready = 0; last_pos = NULL; } while (0)
+#define RESET() do { release_all(); ready = 0; last_pos = NULL; } while (0)
 
 /* Test 1: edge cases that should not crash */
 static void test_edges(void)
@@ -196,61 +1354,81 @@ static void test_edges(void)
 }
 
 /*
-Test 2: Next Fit wrap-around
+Test 2: wrap-around and reuse of a merged block
 
-Fill the buffer completely, then free the first 2 blocks.
-last_pos is still near the end of the buffer.
-The next allocation must scan forward, find nothing, wrap to the start,
-and land in the freed first slot.
+Fill the buffer, then free the first 2 blocks, which merge into the only
+block big enough for the next allocation. Every policy must find it there:
+Next Fit by scanning forward from last_pos (still near the end of the buffer)
+and wrapping to the start, segregated fit and TLSF by looking the merged
+block up in the free list of its size class.
 */
 static void test_wraparound(void)
 {
-    printf("\nTEST 2 - Next Fit wrap-around\n");
+    printf("\nTEST 2 - Wrap-around to a merged block\n");
     RESET();
 
-    void* ptrs[64];
-    int n = 0;
-    while (n < 63) {
-        void* p = myalloc(48); /* fill memory leaving a spot for jsut 1 more 48 byte reservation */
-        ptrs[n++] = p;
+    /*  48 bytes round up to a 56-byte payload, 64 bytes with the header. 63 of those take
+        4032 of the 4080 bytes between the first header and the epilogue, the rest is one
+        free block with a 40-byte payload: too small for another 48, let alone 80 bytes */
+    void* ptrs[63];
+    int ok = 1;
+    for (int n = 0; n < 63; n++) {
+        ptrs[n] = myalloc(48);
+        ok &= ptrs[n] != NULL;
     }
+    CHECK(ok && myalloc(48) == NULL, "63 blocks of 48 bytes fill the buffer");
 
     myfree(ptrs[0]); /* open a slot at the very start; last_pos stays near the end */
-    myfree(ptrs[1]); /* we can't insert something larger than 48 bytes at the end, we need to loop around */
+    myfree(ptrs[1]); /* merged with ptrs[0]: 120 bytes, the only place 80 bytes fit */
 
-    void* d = myalloc(80); /* scan forward from last_pos, find nothing, wrap around */
+    void* d = myalloc(80); /* Next Fit wraps around, the list policies find the merged block by size */
     CHECK(d != NULL, "wrap-around allocation succeeds");
-    CHECK(d < (void*)(mybuffer + 100), "d landed near the start (wrapped)");
+    CHECK(d == ptrs[0], "d landed in the freed, merged first slot");
 
     print_map(); /* we can see that 80 bytes have been reserved and that there is free space at the end and between */
 }
 
-/*
-Test 3: Timing
+#define SAMPLE_EVERY 10000 /* random_ops() iterations between two CSV rows */
+
+static FILE* stats_csv = NULL; /* -s file.csv */
+
+/* Append one row of myalloc_stats() to stats_csv, tagged with the policy name and iteration. */
+static void sample_stats(const char* name, int iter)
+{
+    MyAllocStats st;
+    myalloc_stats(&st);
+    fprintf(stats_csv, "%s,%d,%zu,%zu,%zu,%zu,%.4f,%.3f", name, iter, st.live_bytes, st.free_bytes,
+            st.largest_free, st.free_blocks, st.fragmentation, st.avg_search);
+    for (int i = 0; i < MYALLOC_HIST; i++) {
+        fprintf(stats_csv, ",%zu", st.free_hist[i]);
+    }
+    fprintf(stats_csv, "\n");
+}
 
-Randomly allocate and free randomly sized memory in the buffer over 1 million iterations,
+/*
+The timing workload: randomly allocate and free randomly sized memory 'iters' times,
 using a linear congruential generator with glibc's numbers, effectively reimplementing
 rand() for speed, so the benchmark is as accurate as possible.
+Whatever is still allocated at the end is freed again. With 'sample' set (the
+policy name) and -s given, the heap statistics are written every SAMPLE_EVERY
+iterations, which of course slows the run down.
 */
-static void test_timing(void)
+static void random_ops(uint32_t r, int iters, const char* sample)
 {
-    printf("\nTEST 3 - timing\n");
-    RESET();
-
     int i;
     const int p_c = 64;
     void* p[64] = {0}; /* can't use p_c because the compiler sees it as variable sized */
-    uint32_t r = 1;
-    const int ITERS = 1e6;
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    
-    for (int _ = 0; _ < ITERS; _++) {
+
+    for (int _ = 0; _ < iters; _++) {
         /*  the same glibc LCG numbers used in rand(),
             trying not to disturb the benchmark by 
             writing a custom implementation here with less overhead */
         r = r * 1103515245 + 12345;
 
+        if (sample && _ % SAMPLE_EVERY == 0) {
+            sample_stats(sample, _);
+        }
+
         /*  >> 16 is the same as dividing by 65536 = 2^16, apparently for better randomness it's better to use high bits
             this is based on: https://pubs.opengroup.org/onlinepubs/009695399/functions/rand.html  
             isntead of using `mod p_c` make sure p_c is a power of 2 and use the AND operation instead for speed */
@@ -268,17 +1446,260 @@ static void test_timing(void)
             p[i] = NULL;
         }
     }
-    
+
+    for (i = 0; i < p_c; i++) {
+        if (p[i]) {
+            myfree(p[i]);
+        }
+    }
+}
+
+/* Test 3: Timing, 1 million iterations of random_ops() */
+static void test_timing(const char* name)
+{
+    printf("\nTEST 3 - timing (%s)\n", name);
+    RESET();
+
+    const int ITERS = 1e6;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    random_ops(1, ITERS, stats_csv ? name : NULL);
     clock_gettime(CLOCK_MONOTONIC, &end);
     double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
     printf("Average per malloc/free: %.3f ns\n", (elapsed * 1e9) / ITERS);
+
+    MyAllocStats st;
+    myalloc_stats(&st);
+    printf("Average search length: %.2f blocks over %llu searches\n", st.avg_search, st.searches);
+}
+
+/*
+Test 4: growth
+
+Allocate far more than mybuffer holds, so new arenas get mapped, plus one block
+above BIG_CUTOFF. Then free everything: all mmap'd arenas but KEEP_EMPTY must
+go back to the OS.
+*/
+static void test_growth(void)
+{
+    printf("\nTEST 4 - growth past mybuffer\n");
+    RESET();
+    int old = myalloc_grow(1);
+
+    static void* ptrs[2500];
+    int ok = 1, outside = 0;
+    for (int i = 0; i < 2500; i++) {
+        ptrs[i] = myalloc(1000);
+        ok &= ptrs[i] != NULL;
+        outside += ptrs[i] && ((unsigned char*)ptrs[i] < mybuffer || (unsigned char*)ptrs[i] >= mybuffer + BUFFER_SIZE);
+    }
+    CHECK(ok, "2.5 MB of 1000-byte allocations succeed");
+    CHECK(outside > 2400, "most of them live in mapped arenas");
+
+    unsigned char* big = myalloc(1 << 20);
+    CHECK(big != NULL, "1 MiB request gets its own mapping");
+    big[(1 << 20) - 1] = 7;
+    CHECK(myfree(big) == 0, "big block is freed");
+    CHECK(myfree(big) == -1, "big block double free returns -1");
+
+    int arenas = 0, aligned = 1;
+    for (Arena* a = first_arena.next; a; a = a->next) {
+        arenas++;
+        aligned &= (uintptr_t)a % ARENA_SIZE == 0 && chunk_owner(a->base) == a;
+    }
+    CHECK(aligned, "mapped arenas are ARENA_SIZE aligned and in the chunk map");
+    for (int i = 0; i < 2500; i++) {
+        myfree(ptrs[i]);
+    }
+    int left = 0;
+    for (Arena* a = first_arena.next; a; a = a->next) {
+        left++;
+    }
+    printf("  %d mapped arenas while full, %d after freeing everything\n", arenas, left);
+    CHECK(arenas >= 3 && left == KEEP_EMPTY, "empty arenas beyond KEEP_EMPTY are unmapped");
+    CHECK(myfree(ptrs[2499]) == -1, "double free after the arenas shrank returns -1");
+
+    print_map();
+    myalloc_grow(old);
+}
+
+/*
+Test 6: the rest of the API
+
+myalloc_aligned(), mycalloc() and myrealloc() on the fixed buffer: alignment,
+zeroing, overflow, and that myrealloc() grows into a free neighbour without
+moving the block.
+*/
+static void test_api(void)
+{
+    printf("\nTEST 6 - aligned, calloc, realloc (%zu-byte headers)\n", HEADER_SIZE);
+    RESET();
+
+    unsigned char* a = myalloc_aligned(256, 100);
+    CHECK(a && (uintptr_t)a % 256 == 0, "256-byte aligned allocation");
+    CHECK(myalloc_aligned(48, 100) == NULL, "non power of two alignment returns NULL");
+    CHECK(myfree(a) == 0, "aligned block is freed");
+
+    unsigned char* d = myalloc(200);
+    memset(d, 0xff, 200);
+    myfree(d);
+    unsigned char* z = mycalloc(20, 10);
+    int zero = z != NULL;
+    for (int i = 0; zero && i < 200; i++) {
+        zero = z[i] == 0;
+    }
+    CHECK(zero, "calloc memory is zeroed");
+    CHECK(mycalloc(SIZE_MAX / 2, 4) == NULL, "calloc overflow returns NULL");
+    myfree(z);
+
+    RESET(); /* a fresh buffer, so these four blocks are next to each other */
+    unsigned char* p = myalloc(40);
+    unsigned char* q = myalloc(80);
+    unsigned char* r = myalloc(40); /* keeps q's space from merging with the rest of the buffer */
+    unsigned char* s = myalloc(40); /* used neighbour, r cannot grow in place */
+    memset(p, 7, 40);
+    myfree(q);
+    unsigned char* g = myrealloc(p, 90);
+    CHECK(g == p, "realloc grows into the free neighbour in place");
+    CHECK(g[0] == 7 && g[39] == 7, "contents kept");
+    CHECK(myrealloc(g, 20) == g, "realloc shrinks in place");
+
+    memset(r, 9, 40);
+    unsigned char* m = myrealloc(r, 400);
+    CHECK(m && m != r && m[0] == 9 && m[39] == 9, "realloc moves and copies when it has to");
+    CHECK(myrealloc(m, BUFFER_SIZE * 2) == NULL, "too large realloc returns NULL, block kept");
+    CHECK(m[0] == 9, "contents still there");
+    myfree(m);
+    myfree(s);
+    myfree(g);
+}
+
+/*
+Test 7: statistics
+
+Three blocks with the middle one freed: two free blocks (the hole and the rest
+of mybuffer), and every byte of the buffer is accounted for by payloads,
+headers and the epilogue.
+*/
+static void test_stats(void)
+{
+    printf("\nTEST 7 - statistics\n");
+    RESET();
+
+    void* a = myalloc(48);
+    void* b = myalloc(48);
+    void* c = myalloc(48);
+    myfree(b);
+    MyAllocStats st;
+    myalloc_stats(&st);
+    size_t blocks = st.used_blocks + st.free_blocks;
+    CHECK(st.used_blocks == 2 && st.free_blocks == 2, "2 used and 2 free blocks");
+    CHECK(st.live_bytes == 2 * block_size(48), "live bytes are the two payloads");
+    CHECK(st.span_bytes == 3 * (HEADER_SIZE + block_size(48)), "span ends after the third block, the hole included");
+    CHECK(st.live_bytes + st.free_bytes + (blocks + 1) * HEADER_SIZE == BUFFER_SIZE - FIRST_HDR,
+          "payloads and headers add up to the buffer");
+    CHECK(st.largest_free == st.free_bytes - block_size(48), "largest free block is the rest of the buffer");
+    CHECK(st.fragmentation > 0 && st.fragmentation < 0.05, "a little fragmentation from the hole");
+    CHECK(st.free_hist[1] == 1 && st.free_hist[7] == 1, "histogram: the 56-byte hole and the ~4K rest");
+    CHECK(st.searches == 3 && st.avg_search >= 1, "3 searches, each looked at a block");
+
+    myfree(a);
+    myfree(c);
+    myalloc_stats(&st);
+    CHECK(st.free_blocks == 1 && st.fragmentation == 0, "everything merged back, no fragmentation");
+}
+
+static void* timing_thread(void* arg)
+{
+    random_ops((uint32_t)(uintptr_t)arg, 1e6, NULL);
+    return NULL;
+}
+
+/*
+Test 5: multi-threaded timing
+
+The random_ops() workload in 1, 2, 4 and 8 threads at once, each with its own
+seed and 1 million iterations, in thread-safe mode. Almost every call is a
+thread cache hit, so as long as there are enough cores the total throughput
+should grow close to linearly with the thread count.
+*/
+static void test_timing_mt(void)
+{
+    printf("\nTEST 5 - multi-threaded timing, %ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+    RESET();
+    int old_grow = myalloc_grow(1); /* 8 threads' caches don't fit in mybuffer */
+    myalloc_threads(1);
+
+    double base = 0;
+    for (int n = 1; n <= 8; n *= 2) {
+        pthread_t t[8];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int k = 0; k < n; k++) {
+            pthread_create(&t[k], NULL, timing_thread, (void*)(uintptr_t)(k + 1));
+        }
+        for (int k = 0; k < n; k++) {
+            pthread_join(t[k], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        double mops = n * 1e6 / elapsed / 1e6;
+        if (n == 1) {
+            base = mops;
+        }
+        printf("  %d thread(s): %7.2f M malloc/free per s, %.2fx\n", n, mops, mops / base);
+    }
+
+    myalloc_threads(0);
+    myalloc_grow(old_grow);
 }
 
-int main(void)
+/* every policy runs the whole suite under its own banner */
+static const struct {
+    int fit;
+    const char* title; /* for the banner */
+    const char* name;  /* for the timing line and the CSV */
+} policies[] = {
+    {FIT_NEXT, "Next Fit", "next fit"},
+    {FIT_SEGREGATED, "Segregated Fit", "segregated fit"},
+    {FIT_TLSF, "TLSF", "tlsf"},
+};
+
+int main(int argc, char** argv)
 {
-    printf("=== Custom allocator (Next Fit), buffer = %d bytes ===\n\n", BUFFER_SIZE);
-    test_edges();
-    test_wraparound();
-    test_timing();
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        stats_csv = fopen(argv[2], "w");
+        if (!stats_csv) {
+            perror(argv[2]);
+            return 1;
+        }
+        fprintf(stats_csv, "policy,iteration,live_bytes,free_bytes,largest_free,free_blocks,fragmentation,avg_search");
+        for (int i = 0; i < MYALLOC_HIST; i++) {
+            fprintf(stats_csv, ",hist_%d", 16 << i);
+        }
+        fprintf(stats_csv, "\n");
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-s stats.csv]\n", argv[0]);
+        return 1;
+    }
+
+    myalloc_grow(0); /* tests 1-3 are about the fixed buffer */
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        printf("%s=== Custom allocator (%s), buffer = %d bytes ===\n\n", i ? "\n" : "", policies[i].title, BUFFER_SIZE);
+        myalloc_policy(policies[i].fit);
+        test_edges();
+        test_wraparound();
+        test_timing(policies[i].name);
+        test_growth();
+        test_timing_mt();
+        test_api();
+        test_stats();
+    }
+
+    if (stats_csv) {
+        fclose(stats_csv);
+    }
     return 0;
 }
+
+#endif /* PD_HEAP_LIBRARY */
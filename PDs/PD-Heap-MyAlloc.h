@@ -0,0 +1,51 @@
+/*
+PD-Heap-MyAlloc.h - interface of the PD_Heap allocator in PD-Heap-MyAlloc.c.
+
+Other programs build PD-Heap-MyAlloc.c with -DPD_HEAP_LIBRARY, which leaves
+out its test main(), and link against it. The settings (policy, growth,
+thread mode) may only be changed while a single thread uses the allocator.
+*/
+
+#ifndef PD_HEAP_MYALLOC_H
+#define PD_HEAP_MYALLOC_H
+
+#include <stddef.h>
+
+/* placement policies for myalloc_policy() */
+#define FIT_NEXT 0
+#define FIT_SEGREGATED 1
+#define FIT_TLSF 2
+
+void* myalloc(size_t size);
+int myfree(void* ptr);
+void* myalloc_aligned(size_t align, size_t size);
+void* mycalloc(size_t n, size_t size);
+void* myrealloc(void* ptr, size_t size);
+size_t myalloc_usable_size(void* ptr);
+
+/* A snapshot of the heap, filled in by myalloc_stats(). */
+#define MYALLOC_HIST 16 /* free block size histogram buckets */
+
+typedef struct MyAllocStats {
+    size_t live_bytes;   /* payload of used blocks, big mappings included */
+    size_t span_bytes;   /* each arena up to the end of its last used block, holes included, plus big mappings */
+    size_t free_bytes;   /* payload of free blocks */
+    size_t largest_free; /* payload of the biggest free block */
+    size_t used_blocks;
+    size_t free_blocks;
+    double fragmentation; /* 1 - largest_free / free_bytes: 0 when all free space is one block */
+    size_t free_hist[MYALLOC_HIST]; /* free blocks with payload in [2^(i+4), 2^(i+5)), the last bucket takes the rest */
+    unsigned long long searches; /* heap searches since the heap was set up */
+    unsigned long long probes;   /* blocks looked at by those searches */
+    double avg_search;           /* probes per search */
+} MyAllocStats;
+
+void myalloc_stats(MyAllocStats* s);
+
+int myalloc_policy(int fit);
+int myalloc_grow(int on);
+int myalloc_threads(int on);
+
+void print_map(void);
+
+#endif
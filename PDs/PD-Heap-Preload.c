@@ -0,0 +1,229 @@
+/*
+PD_Heap - LD_PRELOAD build, runs unmodified programs on the PD_Heap allocator
+
+    make PD-Heap-Preload.so
+    LD_PRELOAD=./PD-Heap-Preload.so ../KD1/kd1 ...
+
+Exports malloc, free, calloc, realloc, posix_memalign, aligned_alloc,
+memalign, valloc, pvalloc and malloc_usable_size, which is the set glibc
+needs replaced for a complete malloc replacement.
+
+PD_HEAP picks the engine: next, segregated (default), tlsf, or glibc, which
+passes every call on to glibc's own allocator (its __libc_* entry points)
+so both sides of a comparison run with this library loaded. With
+PD_HEAP_REPORT set, wall time from the first allocation to exit and the
+peak RSS are written to stderr at exit:
+
+    PD_HEAP=glibc PD_HEAP_REPORT=1 LD_PRELOAD=./PD-Heap-Preload.so ./prog
+    PD_HEAP=tlsf  PD_HEAP_REPORT=1 LD_PRELOAD=./PD-Heap-Preload.so ./prog
+
+Early process start: the first malloc can come from inside libc before any
+constructor has run, so the settings are read on that first call, with
+getenv() and nothing that allocates. The allocator itself needs nothing but
+mybuffer and mmap(), and its thread caches are initial-exec TLS (see
+Makefile). Thread mode is always on, the program may start threads at any
+time; switching it on registers fork handlers, and the allocation that
+pthread_atfork() makes then is served normally because the mode is already set.
+
+Pointers the allocator doesn't know (allocated before the library was loaded,
+or garbage) are ignored by free(), glibc would abort instead.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>         /* dlsym */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>         /* snprintf */
+#include <stdlib.h>        /* getenv */
+#include <string.h>
+#include <sys/resource.h>  /* getrusage */
+#include <time.h>
+#include <unistd.h>        /* write, sysconf */
+
+#include "PD-Heap-MyAlloc.h"
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+extern void* __libc_memalign(size_t align, size_t size);
+
+#define MODE_UNSET -1
+#define MODE_GLIBC 3 /* after the three FIT_* policies */
+
+static int mode = MODE_UNSET;
+static int report;
+static struct timespec t_start;
+
+/* First call into the library: read PD_HEAP and PD_HEAP_REPORT. */
+static void configure(void)
+{
+    const char* e = getenv("PD_HEAP");
+    int m = FIT_SEGREGATED;
+    if (e && strcmp(e, "next") == 0) {
+        m = FIT_NEXT;
+    } else if (e && strcmp(e, "tlsf") == 0) {
+        m = FIT_TLSF;
+    } else if (e && strcmp(e, "glibc") == 0) {
+        m = MODE_GLIBC;
+    }
+    report = getenv("PD_HEAP_REPORT") != NULL;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    mode = m; /* set before myalloc_threads(), which may call back into malloc */
+    if (m != MODE_GLIBC) {
+        myalloc_policy(m);
+        myalloc_threads(1);
+    }
+}
+
+#define READY() do { if (mode == MODE_UNSET) configure(); } while (0)
+
+__attribute__((destructor))
+static void pd_report(void)
+{
+    if (!report) {
+        return;
+    }
+    struct timespec t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    static const char* names[] = {"next", "segregated", "tlsf", "glibc"};
+    char line[160];
+    int n = snprintf(line, sizeof(line), "pd-heap: %s, wall %.3f s, max RSS %ld KB\n",
+                     names[mode == MODE_UNSET ? FIT_SEGREGATED : mode],
+                     (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9,
+                     ru.ru_maxrss);
+    if (n > 0 && write(STDERR_FILENO, line, (size_t)n) < 0) {
+        /* nothing left to report to */
+    }
+}
+
+/*
+-------------------------------------------------------------------------------
+exported replacements
+-------------------------------------------------------------------------------
+*/
+
+void* malloc(size_t size)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        return __libc_malloc(size);
+    }
+    void* p = myalloc(size ? size : 1); /* malloc(0) has to be a unique pointer */
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void free(void* ptr)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        __libc_free(ptr);
+        return;
+    }
+    myfree(ptr);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        return __libc_calloc(n, size);
+    }
+    void* p = n && size ? mycalloc(n, size) : myalloc(1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        return __libc_realloc(ptr, size);
+    }
+    void* p = myrealloc(ptr, size);
+    if (!p && size) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+/* Like glibc's: an alignment that is not a power of two is rounded up to one, 0 is malloc. */
+void* memalign(size_t align, size_t size)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        return __libc_memalign(align, size);
+    }
+    if (align > SIZE_MAX / 2 + 1) {
+        errno = EINVAL; /* no power of two that large */
+        return NULL;
+    }
+    size_t pow2 = 1;
+    while (pow2 < align) {
+        pow2 <<= 1;
+    }
+    void* p = myalloc_aligned(pow2, size ? size : 1);
+    if (!p) {
+        errno = ENOMEM;
+    }
+    return p;
+}
+
+/* Unlike memalign, C11 (and glibc since 2.38) rejects an alignment that is not a power of two. */
+void* aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return memalign(align, size);
+}
+
+int posix_memalign(void** out, size_t align, size_t size)
+{
+    if (align % sizeof(void*) != 0 || (align & (align - 1))) {
+        return EINVAL;
+    }
+    int saved = errno; /* posix_memalign reports through its return value only */
+    void* p = memalign(align, size);
+    errno = saved;
+    if (!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+void* valloc(size_t size)
+{
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+    READY();
+    if (mode == MODE_GLIBC) {
+        /* no __libc_ name for this one; dlsym() allocates, but in this mode that goes straight to glibc */
+        static size_t (*real)(void*);
+        if (!real) {
+            real = (size_t (*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+        }
+        return real(ptr);
+    }
+    return myalloc_usable_size(ptr);
+}
@@ -0,0 +1,228 @@
+/*
+PD_Pool - fixed-size object pools next to PD_Heap's myalloc
+
+    MyPool* p = mypool_create(sizeof(struct Rev));
+    struct Rev* r = mypool_alloc(p);
+    mypool_free(p, r);
+    mypool_destroy(p);
+
+For many objects of one struct type there is nothing to search for: every
+free slot fits. A pool gets slabs of SLAB_OBJECTS objects from myalloc()
+and keeps its free objects in an intrusive singly linked list (the first
+word of a free object points to the next one), the same idea as the
+free-index stack in reviewers_final.c, just without the separate index
+array. mypool_alloc() pops the list, mypool_free() pushes onto it, a few
+instructions each. A new slab is not threaded onto the list up front;
+objects are bumped off its unused end until it runs out, so a slab's
+memory is only touched when it is actually used.
+
+Objects go back to the heap only in mypool_destroy(). A pool is not
+thread-safe, give each thread its own. Objects are 16-byte aligned (8 for
+sizes of 8 bytes or less), like what myalloc() returns.
+
+Built with -DPD_POOL_LIBRARY the test main() is left out.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "PD-Heap-MyAlloc.h"
+#include "PD-Pool.h"
+
+#define SLAB_OBJECTS 64 /* objects per slab */
+#define SLAB_HDR 16     /* Slab header, rounded up so the objects stay 16-byte aligned */
+
+/* A slab from myalloc(): this header, then SLAB_OBJECTS objects. */
+typedef struct Slab {
+    struct Slab* next;
+} Slab;
+
+struct MyPool {
+    size_t size;          /* object size, rounded up to its alignment */
+    void* free;           /* intrusive list of freed objects */
+    unsigned char* bump;  /* next never-used object in the newest slab */
+    unsigned char* end;   /* end of the newest slab */
+    Slab* slabs;          /* every slab, for mypool_destroy() */
+};
+
+/* Get another slab and make it the one objects are bumped from. Returns 0 if myalloc() fails. */
+static int add_slab(MyPool* pool)
+{
+    Slab* s = myalloc(SLAB_HDR + SLAB_OBJECTS * pool->size);
+    if (!s) {
+        return 0;
+    }
+    s->next = pool->slabs;
+    pool->slabs = s;
+    pool->bump = (unsigned char*)s + SLAB_HDR;
+    pool->end = pool->bump + SLAB_OBJECTS * pool->size;
+    return 1;
+}
+
+/*
+Create a pool for objects of 'size' bytes.
+Returns NULL if size is 0 or there is not enough space.
+*/
+MyPool* mypool_create(size_t size)
+{
+    if (size == 0 || size > SIZE_MAX / (2 * SLAB_OBJECTS)) {
+        return NULL;
+    }
+    MyPool* pool = myalloc(sizeof(MyPool));
+    if (!pool) {
+        return NULL;
+    }
+    size_t align = size > 8 ? 16 : 8; /* a free object has to hold the list link */
+    pool->size = (size + align - 1) & ~(align - 1);
+    pool->free = NULL;
+    pool->bump = NULL;
+    pool->end = NULL;
+    pool->slabs = NULL;
+    return pool;
+}
+
+/* Allocate one object. Returns NULL if there is not enough space. */
+void* mypool_alloc(MyPool* pool)
+{
+    void* obj = pool->free;
+    if (obj) {
+        pool->free = *(void**)obj; /* pop */
+        return obj;
+    }
+    if (pool->bump == pool->end && !add_slab(pool)) {
+        return NULL;
+    }
+    obj = pool->bump;
+    pool->bump += pool->size;
+    return obj;
+}
+
+/* Give an object back to its pool. It must have come from mypool_alloc() on the same pool. */
+void mypool_free(MyPool* pool, void* obj)
+{
+    *(void**)obj = pool->free; /* push */
+    pool->free = obj;
+}
+
+/* Give every slab, and the pool itself, back to the heap. All its objects become invalid. */
+void mypool_destroy(MyPool* pool)
+{
+    Slab* s = pool->slabs;
+    while (s) {
+        Slab* next = s->next;
+        myfree(s);
+        s = next;
+    }
+    myfree(pool);
+}
+
+/*
+-------------------------------------------------------------------------------
+end of main functions
+-------------------------------------------------------------------------------
+start of testing helper functions
+-------------------------------------------------------------------------------
+*/
+
+#ifndef PD_POOL_LIBRARY
+
+#define CHECK(cond, msg) printf("  %s %s\n", (cond) ? "[PASS]" : "[FAIL]", msg)
+
+/* a typical small record, 40 bytes */
+typedef struct Rec {
+    int id;
+    char name[20];
+    double score;
+    struct Rec* next;
+} Rec;
+
+/* Test 1: objects are distinct, aligned and writable; freed ones are reused before new slabs. */
+static void test_reuse(void)
+{
+    printf("TEST 1 - allocate, free, reuse\n");
+    MyPool* pool = mypool_create(sizeof(Rec));
+    CHECK(pool != NULL, "pool created");
+    CHECK(mypool_create(0) == NULL, "zero-size pool returns NULL");
+
+    static Rec* r[1000];
+    int ok = 1;
+    for (int i = 0; i < 1000; i++) {
+        r[i] = mypool_alloc(pool);
+        ok &= r[i] != NULL && (uintptr_t)r[i] % 16 == 0;
+        if (r[i]) {
+            r[i]->id = i;
+        }
+    }
+    CHECK(ok, "1000 objects, all 16-byte aligned");
+    for (int i = 0; i < 1000; i++) {
+        ok &= r[i]->id == i;
+    }
+    CHECK(ok, "no two objects overlap");
+
+    Slab* slabs = pool->slabs;
+    unsigned char* bump = pool->bump;
+    for (int i = 0; i < 1000; i += 2) {
+        mypool_free(pool, r[i]);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        r[i] = mypool_alloc(pool);
+    }
+    CHECK(pool->slabs == slabs && pool->bump == bump, "freed objects are reused, no new slab");
+
+    mypool_destroy(pool);
+}
+
+/*
+Test 2: Timing
+
+The same random alloc/free pattern as PD-Heap's test_timing, but with one object
+size, through a pool and through myalloc()/myfree().
+*/
+static void test_timing(void)
+{
+    printf("\nTEST 2 - timing, %zu-byte objects\n", sizeof(Rec));
+    const int ITERS = 1e6;
+    for (int use_pool = 1; use_pool >= 0; use_pool--) {
+        MyPool* pool = mypool_create(sizeof(Rec));
+        void* p[64] = {0};
+        uint32_t r = 1;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int _ = 0; _ < ITERS; _++) {
+            r = r * 1103515245 + 12345; /* glibc's rand() LCG */
+            int i = (r >> 16) & 63;
+            if (r & 1) {
+                if (!p[i]) {
+                    p[i] = use_pool ? mypool_alloc(pool) : myalloc(sizeof(Rec));
+                }
+            } else if (p[i]) {
+                if (use_pool) {
+                    mypool_free(pool, p[i]);
+                } else {
+                    myfree(p[i]);
+                }
+                p[i] = NULL;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("  %-8s average per alloc/free: %.3f ns\n", use_pool ? "pool" : "myalloc", (elapsed * 1e9) / ITERS);
+        for (int i = 0; i < 64; i++) {
+            if (p[i] && !use_pool) {
+                myfree(p[i]);
+            }
+        }
+        mypool_destroy(pool);
+    }
+}
+
+int main(void)
+{
+    printf("=== Object pool on PD_Heap ===\n\n");
+    test_reuse();
+    test_timing();
+    return 0;
+}
+
+#endif /* PD_POOL_LIBRARY */
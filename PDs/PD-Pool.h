@@ -0,0 +1,20 @@
+/*
+PD-Pool.h - fixed-size object pools on top of the PD_Heap allocator.
+
+One pool hands out objects of a single size, carved from slabs that come
+from myalloc(). See PD-Pool.c.
+*/
+
+#ifndef PD_POOL_H
+#define PD_POOL_H
+
+#include <stddef.h>
+
+typedef struct MyPool MyPool;
+
+MyPool* mypool_create(size_t size);
+void* mypool_alloc(MyPool* pool);
+void mypool_free(MyPool* pool, void* obj);
+void mypool_destroy(MyPool* pool);
+
+#endif
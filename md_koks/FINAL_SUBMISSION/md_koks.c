@@ -1,395 +1,970 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h> // used only for string copy once
-#define MAX_LEN 128 // assume names are less than 128 characters - can be modified if necessary
-
-
-typedef struct Node {
-    char data[MAX_LEN];
-    struct Node* father;
-    struct Node* mother;
-} Node;
-
-// for keeping track of node name duplicates
-// for having a complete linked list of all nodes from a single root
-typedef struct Nodes {
-    int declared; 
-    int layer;
-    struct Node* node;
-    struct Nodes* next;
-} Nodes;
-
-// for keeping track of separate graphs
-// so it's possible to update all layers when a new graph gets added
-typedef struct Graph {
-    int id;
-    struct Graph* next;
-    struct Nodes* set; // linked list of all nodes that belong
-} Graph;
-
-
-Node* createNode(char data[MAX_LEN]) 
-{
-    Node* newNode = (Node*)malloc(sizeof(Node));
-    strcpy(newNode->data, data);
-    newNode->father = NULL;
-    newNode->mother = NULL;
-    return newNode;
-}
-
-Nodes* createNodes(Node* node) 
-{
-    Nodes* new_node = (Nodes*)malloc(sizeof(Nodes));
-    new_node->declared = 0;
-    new_node->layer = 1;
-    // new_node->graphID = -1;
-    new_node->node = node;
-    new_node->next = NULL;
-    return new_node;
-}
-
-Nodes* appendNodes(Nodes* start, Nodes* node)
-{
-    Nodes* p = start;
-    while(p->next) {
-        p = p->next;
-    }
-    p->next = node;
-}
-
-// try to find a Nodes entry; create a new Nodes entry if it doesn't exist; 
-// if declaring, then mark the entry as declared and fail when declaring it (naming it's parents) for the second time;
-// return the Nodes entry it represents once found or created
-Nodes* insertNodeIntoNodes(Nodes* start, Node* node, int declaring) 
-{
-    Nodes* crnt = start;
-    Nodes* prev = NULL;
-    char node_name[MAX_LEN];
-    strncpy(node_name, node->data, MAX_LEN);
-    node_name[MAX_LEN-1] = '\0';
-    while (crnt) {
-        if (strcmp(crnt->node->data, node_name) == 0) {
-            if (declaring) {
-                if (crnt->declared) {
-                    printf("Name %s was already declared!\n", node_name);
-                    exit(1);
-                } else {
-                    crnt->declared = 1;
-                    return crnt;
-                }
-            } else {
-                return crnt;
-            }
-        }
-        prev = crnt;
-        crnt = crnt->next;
-    }
-    prev->next = createNodes(node);
-    prev = prev->next;
-    if (declaring) {prev->declared = 1;}
-    return prev;
-}
-
-Nodes* findNodeInNodes(Nodes* start, const char data[MAX_LEN]) 
-{
-    Nodes* tmp = start;
-    while (tmp) {
-        if (strcmp(tmp->node->data, data) == 0)
-            return tmp;
-        tmp = tmp->next;
-    }
-    return NULL;
-}
-
-Graph* createGraph(Nodes* start, int id) 
-{
-    Graph* newGraph = (Graph*)malloc(sizeof(Graph));
-    newGraph->id = id;
-    newGraph->set = start;
-    newGraph->next = NULL;
-    return newGraph;
-}
-
-void appendGraph(Graph* start, Graph* g) 
-{
-    Graph* p = start; 
-    while (p->next) { 
-        p = p->next; 
-    } 
-    p->next = g;
-}
-
-void addToGraph(Graph* graph, Nodes* n) 
-{
-    Nodes* p1 = graph->set;
-    Nodes* p2 = n;
-    // check for duplicates
-    while (p2->next) {
-        if (!findNodeInNodes(p1, p2->node->data)) {
-            appendNodes(p1, p2);
-        }
-        p2 = p2->next;
-    }
-}
-
-// crnt_g_id is used to prevent parsing the graph we are currently building when we check for already visited nodes in other graphs
-int findNodeInGraphs(Graph* start, const char data[MAX_LEN], int crnt_g_id, Graph** found_in, Nodes** found) 
-{
-    Graph* crnt_g = start;
-    while(crnt_g) {
-        if (crnt_g_id > -1 && crnt_g_id == crnt_g->id) {
-            crnt_g = crnt_g->next;
-            continue;
-        }
-        Nodes* n = findNodeInNodes(crnt_g->set, data);
-        if (n) {
-            if (found && found_in) {
-                *found_in = crnt_g;
-                *found = n;
-            }
-            return 1;
-        }
-        crnt_g = crnt_g->next;
-    }
-    return 0;
-}
-
-void changeGraphLayers(Graph* start, int diff) 
-{
-    Nodes* p = start->set; 
-    while (p) { 
-        p->layer += diff;
-        p = p->next; 
-    } 
-}
-
-void unlinkGraph(Graph** start, int id) 
-{
-    Graph* crnt = *start;
-    Graph* prev = NULL;
-    while (crnt) {
-        if (crnt->id == id) {
-            if (prev) {
-                prev->next = crnt->next;
-            } else {
-                *start = crnt->next;
-            }
-            return;
-        }
-        prev = crnt;
-        crnt = crnt->next;
-    }
-}
-
-Graph* mergeGraphs(Graph* dest, Graph* src)
-{
-    // check for all nodes that connect - need to be removed to prevent loops
-    Nodes* tail = dest->set;
-    while (tail->next) {
-        tail = tail->next;
-    }
-    Nodes* p1 = src->set;
-    while(p1) {
-        if (!findNodeInNodes(dest->set, p1->node->data)) {
-            Nodes* copy = malloc(sizeof(Nodes));
-            *copy = *p1;
-            copy->next = NULL;
-            tail->next = copy;
-            tail = tail->next;
-        }
-        p1 = p1->next;
-    }
-    return dest;
-}
-
-// currently visited Nodes are for loop and wrong generation detection 
-// - if a node has a parent from already visited nodes that doesn't have 
-// a layer assigned exactly one above, then it's either a loop, or a violation
-// of the assignment requirements that generations that differ by more than 1 do not interact.
-void recurseNodesAssignLayers(Nodes* currently_visited, Nodes* crnt, int layer) 
-{
-    crnt->layer = layer;
-    Nodes* original = findNodeInNodes(currently_visited, crnt->node->data);
-    if (original && original != crnt) {
-        if (original->layer != layer) {
-            printf("Either there is a loop, or different generations have had children together.\nIssue at node %s.\n", crnt->node->data);
-            exit(1);
-        }
-        return;
-    } 
-    if (!original) {
-        appendNodes(currently_visited, crnt);
-    }
-    // we can pass the same functionally global currently_visited set to every call, because we check layers
-    if (crnt->node->mother) {
-        Nodes* crnt_mother = createNodes(crnt->node->mother);
-        recurseNodesAssignLayers(currently_visited, crnt_mother, layer+1);
-    } 
-    if (crnt->node->father) {
-        Nodes* crnt_father = createNodes(crnt->node->father);
-        recurseNodesAssignLayers(currently_visited, crnt_father, layer+1);
-    }
-}
-
-Nodes* populate_graph(FILE* fptr) 
-{
-    char category[MAX_LEN]; // VARDS / TEVS / MATE
-    char node[MAX_LEN];
-    int f_seen = 0;
-    int m_seen = 0;
-    Node* crnt_node = NULL;
-    Nodes* nodes_start = NULL;
-
-    // Assume input data follows the correct format
-    fscanf(fptr, "%s %s", category, node);
-    if (strcmp(category, "VARDS") == 0) {
-            crnt_node = createNode(node);
-            nodes_start = createNodes(crnt_node);
-            nodes_start->declared = 1;
-            f_seen = 0;
-            m_seen = 0;
-    } else {
-        printf("File needs to start with 'VARDS'.\n");
-        exit(1);
-    }
-    while (fscanf(fptr, "%s %s", category, node) == 2) {
-        if (strcmp(category, "VARDS") == 0) {
-            crnt_node = insertNodeIntoNodes(nodes_start, createNode(node), 1)->node;
-            f_seen = 0;
-            m_seen = 0;
-        } else if (strcmp(category, "TEVS") == 0) {
-            if (f_seen) {
-                printf("Cannot have 2 fathers.\n");
-                exit(1);
-            }
-            crnt_node->father = insertNodeIntoNodes(nodes_start, createNode(node), 0)->node;
-            f_seen = 1;
-        } else if (strcmp(category, "MATE") == 0) {
-            if (m_seen) {
-                printf("Cannot have 2 mothers.\n");
-                exit(1);
-            }
-            crnt_node->mother = insertNodeIntoNodes(nodes_start, createNode(node), 0)->node;
-            m_seen = 1;
-        } else {
-            printf("Invalid input.\n");
-            exit(1);
-        }
-    }
-    // fclose(fptr);
-    return nodes_start;
-}
-
-int main() 
-{
-    // ------------------------------------------------------------------
-    // POPULATE THE NODE GRAPH AND KEEP A LIST OF EXISTING NODES
-    // ------------------------------------------------------------------
-    
-    FILE* fptr = stdin;
-    if(fptr == NULL) {
-        printf("Not able to open the file.\n");
-        return 1;
-    }
-    Nodes* nodes_start = populate_graph(fptr);
-
-    // ------------------------------------------------------------------
-    // WALK THE NODES LIST AND ASSIGN GENERATIONS; SPLIT GRAPHS; DETECT LOOPS
-    // ------------------------------------------------------------------
-
-    int gID = 1;
-    Graph* graphs = NULL;
-    Nodes* n = nodes_start;
-    Nodes* next = NULL;
-    while (n) {
-        next = n->next; // reuse n for graphs
-        n->next = NULL; // disconnect from the original list
-        if (n->declared) {
-            if (graphs) { 
-                // check if the node has already been processed
-                if (!findNodeInGraphs(graphs, n->node->data, -1, NULL, NULL)) {
-                    Nodes* visited = n;
-                    int layer = 1;
-                    recurseNodesAssignLayers(visited, n, layer);
-                    // we must check if there are currently visited nodes that were found before
-                    // if so, then have to balance layers and merge the graphs
-                    int at_least_one = 0;
-                    Nodes* v = visited;
-                    Graph* tmp_graph = createGraph(visited, gID);
-                    while(v) {
-                        Graph* other_graph = NULL;
-                        Nodes* other_node = NULL;
-                        findNodeInGraphs(graphs, v->node->data, tmp_graph->id, &other_graph, &other_node);
-                        if (other_graph && other_node) { // a different graph with the same Nodes object was found -> merge together
-                            at_least_one = 1;
-                            int l1 = v->layer;
-                            int l2 = other_node->layer;
-                            if (l1 < l2) {
-                                changeGraphLayers(tmp_graph, l2-l1);
-                            } else if (l1 > l2) {
-                                changeGraphLayers(other_graph, l1-l2);
-                            }
-                            // later on tmp_graph becomes a graph that's already within graphs,
-                            // so we need to unlink it from the global list to prevent duplicates
-                            unlinkGraph(&graphs, tmp_graph->id); 
-                            tmp_graph = mergeGraphs(other_graph, tmp_graph);
-                        }
-                        v = v->next;
-                    }
-                    if (!at_least_one) { // no connections with existing graphs
-                        Graph* g = tmp_graph;
-                        appendGraph(graphs, g);
-                        addToGraph(g, visited);
-                        gID++;
-                    }
-                }
-            } else { // first graph
-                Nodes* visited = n;
-                int layer = 1;
-                recurseNodesAssignLayers(visited, n, layer);
-                graphs = createGraph(n, gID);
-                gID++;
-            }
-        }
-        n = next;
-    }
-
-    // ------------------------------------------------------------------
-    // PRINT THE GRAPHS IN DESCENDING ORDER OF LAYERS
-    // ------------------------------------------------------------------
-
-    Graph* crnt_g = graphs;
-    while(crnt_g) {
-        // count
-        int c = 0;
-        Nodes* n = crnt_g->set;
-        while(n) {n = n->next; c++;}
-        // create array
-        Nodes** arr = malloc(c*sizeof(Nodes*));
-        n = crnt_g->set;
-        for (int i = 0; i < c; i++) {
-            arr[i] = n;
-            n = n->next;
-        }
-        // bubble sort
-        for (int i = 0; i < c; i++) {
-            for (int j = i+1; j < c; j++) {
-                if (arr[i]->layer < arr[j]->layer) {
-                    Nodes* tmp = arr[i];
-                    arr[i] = arr[j];
-                    arr[j] = tmp;
-                }
-            }
-        }
-        // print
-        for (int i = 0; i < c; i++) {
-            printf("%s\n", arr[i]->node->data);
-        }
-        printf("\n");
-
-        free(arr);
-        crnt_g = crnt_g->next;
-    }
-
-    return 0;
-}
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define READ_BLOCK (1 << 20) // bytes read at a time when the input can't be mapped
+
+
+// every person read, one entry per id in each array (ids go 0, 1, 2 ... in the
+// order names are first read). The names are never copied: each one is where
+// it was first read in the input, which stays in memory until the end.
+typedef struct People {
+    int count;
+    int cap;
+    size_t* name;  // offset of the name in text
+    int* len;      // length of the name, it is not '\0' terminated
+    int* father;   // id, -1 if not given
+    int* mother;
+    int* layer;    // generation, relative within the family; filled in before printing
+    int* family;   // output position of the family; filled in before printing
+    char* declared;
+    const char* text; // the whole input
+} People;
+
+// generations, checked while reading: a weighted union-find over node ids where
+// every node keeps its layer relative to its parent in the tree. Each TEVS/MATE
+// line either joins two sets, the parent one layer above the child, or, if both
+// are already in one set, has to agree with the layers it already implies.
+// A loop, or parents from two generations, can't agree, so both are caught on
+// the line that causes them.
+typedef struct Generations {
+    int* parent;
+    unsigned char* rank;
+    int* offset; // layer of the node minus layer of its parent in the tree
+} Generations;
+
+// for keeping track of separate graphs (families): a union-find over node ids,
+// one set per graph, merged in the order the graphs meet. Only roots use head, tail and slot.
+typedef struct Families {
+    int* parent;
+    unsigned char* rank;
+    char* placed; // the node already belongs to a graph
+    int* next;    // next member of the graph, -1 after the last one
+    int* head;    // first and last member, in the order they are printed before sorting
+    int* tail;
+    int* slot;    // position of the graph in the output
+    int* size;    // number of members
+} Families;
+
+// hash index of every name read, name -> id
+// open addressing with linear probing, the table doubles when it gets half full
+typedef struct NameIndex {
+    int* slots;  // id, -1 if empty
+    size_t cap;  // always a power of 2
+} NameIndex;
+
+People people = {0};
+NameIndex names = {NULL, 0};
+Generations gen = {NULL, NULL, NULL};
+Families fam;
+
+void* allocOrExit(size_t n, size_t size)
+{
+    void* p = calloc(n, size);
+    if (!p) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+void* reallocOrExit(void* p, size_t n, size_t size)
+{
+    p = realloc(p, n * size);
+    if (!p) {
+        printf("Out of memory.\n");
+        exit(1);
+    }
+    return p;
+}
+
+const char* nameOf(int id)
+{
+    return people.text + people.name[id];
+}
+
+// FNV-1a
+size_t hashName(const char* name, int len)
+{
+    size_t h = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+int sameName(int id, const char* name, int len)
+{
+    return people.len[id] == len && memcmp(nameOf(id), name, len) == 0;
+}
+
+// slot of name in the index: either the one holding it, or the empty one where it belongs
+size_t indexSlot(const char* name, int len)
+{
+    size_t i = hashName(name, len) & (names.cap - 1);
+    while (names.slots[i] >= 0 && !sameName(names.slots[i], name, len)) {
+        i = (i + 1) & (names.cap - 1);
+    }
+    return i;
+}
+
+void indexGrow(void)
+{
+    int* old = names.slots;
+    size_t old_cap = names.cap;
+    names.cap = old_cap ? old_cap * 2 : 1024;
+    names.slots = reallocOrExit(NULL, names.cap, sizeof(int));
+    for (size_t i = 0; i < names.cap; i++) {
+        names.slots[i] = -1;
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i] >= 0) {
+            names.slots[indexSlot(nameOf(old[i]), people.len[old[i]])] = old[i];
+        }
+    }
+    free(old);
+}
+
+// a new person whose name is the len bytes at offset at in the input,
+// with no parents yet and a generation set of their own
+int addPerson(size_t at, int len)
+{
+    if (people.count == people.cap) {
+        people.cap = people.cap ? people.cap * 2 : 1024;
+        people.name = reallocOrExit(people.name, people.cap, sizeof(size_t));
+        people.len = reallocOrExit(people.len, people.cap, sizeof(int));
+        people.father = reallocOrExit(people.father, people.cap, sizeof(int));
+        people.mother = reallocOrExit(people.mother, people.cap, sizeof(int));
+        people.declared = reallocOrExit(people.declared, people.cap, sizeof(char));
+        gen.parent = reallocOrExit(gen.parent, people.cap, sizeof(int));
+        gen.rank = reallocOrExit(gen.rank, people.cap, sizeof(unsigned char));
+        gen.offset = reallocOrExit(gen.offset, people.cap, sizeof(int));
+    }
+    int id = people.count++;
+    people.name[id] = at;
+    people.len[id] = len;
+    people.father[id] = -1;
+    people.mother[id] = -1;
+    people.declared[id] = 0;
+    gen.parent[id] = id;
+    gen.rank[id] = 0;
+    gen.offset[id] = 0;
+    return id;
+}
+
+// root of id's set, with path compression; *layer gets id's layer relative to the root
+int findGeneration(int id, int* layer)
+{
+    int root = id;
+    int sum = 0;
+    while (gen.parent[root] != root) {
+        sum += gen.offset[root];
+        root = gen.parent[root];
+    }
+    // second walk: point everything on the path straight at the root
+    int rest = sum;
+    while (gen.parent[id] != id) {
+        int up = gen.parent[id];
+        int off = gen.offset[id];
+        gen.parent[id] = root;
+        gen.offset[id] = rest;
+        rest -= off;
+        id = up;
+    }
+    *layer = sum;
+    return root;
+}
+
+// parent has to be exactly one layer above child
+void linkParent(int child, int parent)
+{
+    int lc, lp;
+    int rc = findGeneration(child, &lc);
+    int rp = findGeneration(parent, &lp);
+    if (rc == rp) {
+        if (lp != lc + 1) {
+            printf("Either there is a loop, or different generations have had children together.\nIssue at node %.*s, parent of %.*s.\n",
+                   people.len[parent], nameOf(parent), people.len[child], nameOf(child));
+            exit(1);
+        }
+        return;
+    }
+    // union by rank: shift the attached set so that lp ends up at lc + 1
+    int diff = lc + 1 - lp;
+    if (gen.rank[rp] < gen.rank[rc]) {
+        gen.parent[rp] = rc;
+        gen.offset[rp] = diff;
+    } else {
+        gen.parent[rc] = rp;
+        gen.offset[rc] = -diff;
+        if (gen.rank[rp] == gen.rank[rc]) {
+            gen.rank[rp]++;
+        }
+    }
+}
+
+// try to find a person by name; add them if they don't exist yet;
+// if declaring, then mark them as declared and fail when declaring them (naming their parents) for the second time;
+// return their id once found or added
+int internName(const char* name, int len, int declaring)
+{
+    if (2 * (size_t)(people.count + 1) > names.cap) {
+        indexGrow();
+    }
+    size_t i = indexSlot(name, len);
+    int id = names.slots[i];
+    if (id < 0) {
+        id = addPerson(name - people.text, len);
+        names.slots[i] = id;
+    } else if (declaring && people.declared[id]) {
+        printf("Name %.*s was already declared!\n", len, name);
+        exit(1);
+    }
+    if (declaring) {people.declared[id] = 1;}
+    return id;
+}
+
+// every node starts as a graph of its own that is not placed yet
+void createFamilies(int count)
+{
+    fam.parent = allocOrExit(count, sizeof(int));
+    fam.rank = allocOrExit(count, sizeof(unsigned char));
+    fam.placed = allocOrExit(count, sizeof(char));
+    fam.next = allocOrExit(count, sizeof(int));
+    fam.head = allocOrExit(count, sizeof(int));
+    fam.tail = allocOrExit(count, sizeof(int));
+    fam.slot = allocOrExit(count, sizeof(int));
+    fam.size = allocOrExit(count, sizeof(int));
+    for (int id = 0; id < count; id++) {
+        fam.parent[id] = id;
+        fam.next[id] = -1;
+        fam.head[id] = id;
+        fam.tail[id] = id;
+        fam.size[id] = 1;
+    }
+}
+
+// root of id's graph, with path compression
+int findFamily(int id)
+{
+    int root = id;
+    while (fam.parent[root] != root) {
+        root = fam.parent[root];
+    }
+    while (fam.parent[id] != root) {
+        int up = fam.parent[id];
+        fam.parent[id] = root;
+        id = up;
+    }
+    return root;
+}
+
+// merge graph a into graph b (both roots): b's members come first
+// and the result takes b's place in the output; returns the new root
+int mergeFamilies(int a, int b)
+{
+    int head = fam.head[b];
+    int tail = fam.tail[a];
+    int slot = fam.slot[b];
+    int size = fam.size[a] + fam.size[b];
+    fam.next[fam.tail[b]] = fam.head[a];
+
+    // union by rank
+    int root;
+    if (fam.rank[a] < fam.rank[b]) {
+        fam.parent[a] = b;
+        root = b;
+    } else {
+        fam.parent[b] = a;
+        if (fam.rank[a] == fam.rank[b]) {
+            fam.rank[a]++;
+        }
+        root = a;
+    }
+    fam.head[root] = head;
+    fam.tail[root] = tail;
+    fam.slot[root] = slot;
+    fam.size[root] = size;
+    return root;
+}
+
+// start's graph: walk its ancestors depth first, mother before father, each person once.
+// Nobody is visited twice, not even across graphs: a person some graph already has
+// brings all their ancestors along, so the walk merges that graph in and stops there.
+// The new people join the graph in visiting order, after the members of every graph
+// merged in, the latest first. stack needs room for 2 ids per node, plus one.
+void buildFamily(int start, int slot, int* stack)
+{
+    int top = 0;
+    fam.slot[start] = slot;
+    fam.placed[start] = 1;
+    stack[top++] = start;
+    while (top) {
+        int v = stack[--top];
+        int own = findFamily(start);
+        if (v != start) {
+            if (fam.placed[v]) {
+                int other = findFamily(v);
+                if (other != own) {
+                    mergeFamilies(own, other);
+                }
+                continue;
+            }
+            fam.placed[v] = 1;
+            fam.parent[v] = own;
+            if (fam.rank[own] == 0) {
+                fam.rank[own] = 1;
+            }
+            fam.next[fam.tail[own]] = v;
+            fam.tail[own] = v;
+            fam.size[own]++;
+        }
+        // pushed the other way round, so the mother's side comes off first
+        if (people.father[v] >= 0) {
+            stack[top++] = people.father[v];
+        }
+        if (people.mother[v] >= 0) {
+            stack[top++] = people.mother[v];
+        }
+    }
+}
+
+// counting sort of arr into out, highest layer first; people of the same layer keep
+// their order from arr. A graph is connected and every link is one layer, so its
+// layers span at most c values and this is O(c).
+void sortByLayers(const int* arr, int c, int* out)
+{
+    if (c == 0) {
+        return;
+    }
+    int min = people.layer[arr[0]];
+    int max = min;
+    for (int i = 1; i < c; i++) {
+        int l = people.layer[arr[i]];
+        if (l < min) {min = l;}
+        if (l > max) {max = l;}
+    }
+    // start[l - min] = where the first person of layer l goes
+    int* start = allocOrExit(max - min + 2, sizeof(int));
+    for (int i = 0; i < c; i++) {
+        start[people.layer[arr[i]] - min]++;
+    }
+    int pos = 0;
+    for (int l = max; l >= min; l--) {
+        int count = start[l - min];
+        start[l - min] = pos;
+        pos += count;
+    }
+    for (int i = 0; i < c; i++) {
+        out[start[people.layer[arr[i]] - min]++] = arr[i];
+    }
+    free(start);
+}
+
+// the graph with this root, ready to print: its members go into arr, their layers into
+// people.layer and the sorted order into out; returns the number of members.
+// Touches nothing outside the graph (its generations are one set of their own as well),
+// so different graphs can be done at the same time.
+int layerFamily(int root, int* arr, int* out)
+{
+    int c = 0;
+    for (int m = fam.head[root]; m >= 0; m = fam.next[m]) {
+        findGeneration(m, &people.layer[m]);
+        arr[c++] = m;
+    }
+    sortByLayers(arr, c, out);
+    return c;
+}
+
+// one graph for the worker threads (-j), and its printed lines once it is done
+typedef struct Job {
+    int root;
+    int slot;
+    char* text;
+    size_t text_len;
+} Job;
+
+// the jobs, largest graph first, and the next one nobody has taken yet
+typedef struct Pool {
+    Job** order;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} Pool;
+
+// biggest first, so a big graph taken last doesn't keep one thread busy after the rest are done
+int compareJobs(const void* a, const void* b)
+{
+    const Job* x = *(Job* const*)a;
+    const Job* y = *(Job* const*)b;
+    if (fam.size[x->root] != fam.size[y->root]) {
+        return fam.size[x->root] > fam.size[y->root] ? -1 : 1;
+    }
+    return x->slot - y->slot;
+}
+
+void* layerWorker(void* arg)
+{
+    Pool* pool = arg;
+    int* arr = NULL;
+    int* sorted = NULL;
+    int cap = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        int j = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (j >= pool->count) {
+            break;
+        }
+        Job* job = pool->order[j];
+        int size = fam.size[job->root];
+        if (size > cap) {
+            cap = size;
+            arr = reallocOrExit(arr, cap, sizeof(int));
+            sorted = reallocOrExit(sorted, cap, sizeof(int));
+        }
+        int c = layerFamily(job->root, arr, sorted);
+
+        // the same lines the sequential loop in main prints
+        size_t len = 1;
+        for (int i = 0; i < c; i++) {
+            len += people.len[sorted[i]] + 1;
+        }
+        char* text = allocOrExit(len, 1);
+        char* t = text;
+        for (int i = 0; i < c; i++) {
+            memcpy(t, nameOf(sorted[i]), people.len[sorted[i]]);
+            t += people.len[sorted[i]];
+            *t++ = '\n';
+        }
+        *t = '\n';
+        job->text = text;
+        job->text_len = len;
+    }
+    free(arr);
+    free(sorted);
+    return NULL;
+}
+
+// -j: lay out and sort the graphs (roots in output order) on threads worker threads,
+// then print them in the same order as without -j
+void printFamiliesParallel(const int* roots, int n, int threads)
+{
+    Job* jobs = allocOrExit(n, sizeof(Job));
+    Pool pool = {allocOrExit(n, sizeof(Job*)), n, 0, PTHREAD_MUTEX_INITIALIZER};
+    for (int i = 0; i < n; i++) {
+        jobs[i].root = roots[i];
+        jobs[i].slot = i;
+        pool.order[i] = &jobs[i];
+    }
+    qsort(pool.order, n, sizeof(Job*), compareJobs);
+
+    if (threads > n) {
+        threads = n;
+    }
+    pthread_t* workers = allocOrExit(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, layerWorker, &pool) != 0) {
+            printf("Could not start a thread.\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (int i = 0; i < n; i++) {
+        fwrite(jobs[i].text, 1, jobs[i].text_len, stdout);
+        free(jobs[i].text);
+    }
+    free(workers);
+    free(pool.order);
+    free(jobs);
+}
+
+// the whole of fptr in memory: mapped if it is a regular file, otherwise read
+// READ_BLOCK bytes at a time into one growing buffer. Never freed, the names point into it.
+const char* readInput(FILE* fptr, size_t* size)
+{
+    struct stat st;
+    int fd = fileno(fptr);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+            return map;
+        }
+    }
+    size_t used = 0;
+    size_t cap = READ_BLOCK;
+    char* buf = allocOrExit(cap, 1);
+    size_t got;
+    while ((got = fread(buf + used, 1, cap - used, fptr)) > 0) {
+        used += got;
+        if (used == cap) {
+            cap *= 2;
+            buf = reallocOrExit(buf, cap, 1);
+        }
+    }
+    *size = used;
+    return buf;
+}
+
+// same characters as isspace() in the C locale, which is what fscanf("%s") stopped at
+int isBlank(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// next whitespace separated word at or after *p, NULL if there are none left
+const char* nextWord(const char** p, const char* end, int* len)
+{
+    const char* s = *p;
+    while (s < end && isBlank(*s)) {
+        s++;
+    }
+    if (s == end) {
+        return NULL;
+    }
+    const char* e = s;
+    while (e < end && !isBlank(*e)) {
+        e++;
+    }
+    *p = e;
+    *len = e - s;
+    return s;
+}
+
+// the keyword of a line: 'V' for VARDS, 'T' for TEVS, 'M' for MATE, 0 for anything else.
+// The first byte picks the only keyword it can be, a single compare then checks the rest.
+char keyword(const char* word, int len)
+{
+    switch (word[0]) {
+    case 'V':
+        return len == 5 && memcmp(word, "VARDS", 5) == 0 ? 'V' : 0;
+    case 'T':
+        return len == 4 && memcmp(word, "TEVS", 4) == 0 ? 'T' : 0;
+    case 'M':
+        return len == 4 && memcmp(word, "MATE", 4) == 0 ? 'M' : 0;
+    }
+    return 0;
+}
+
+void populate_graph(FILE* fptr)
+{
+    size_t size;
+    people.text = readInput(fptr, &size);
+    const char* p = people.text;
+    const char* end = people.text + size;
+    int f_seen = 0;
+    int m_seen = 0;
+    int crnt = -1;
+
+    // Assume input data follows the correct format: keyword, name, keyword, name ...
+    // A keyword with no name after it at the very end is ignored.
+    const char* category;
+    const char* node;
+    int category_len, node_len;
+    int first = 1;
+    while ((category = nextWord(&p, end, &category_len)) && (node = nextWord(&p, end, &node_len))) {
+        char kind = keyword(category, category_len);
+        if (first && kind != 'V') {
+            break;
+        }
+        first = 0;
+        if (kind == 'V') {
+            crnt = internName(node, node_len, 1);
+            f_seen = 0;
+            m_seen = 0;
+        } else if (kind == 'T') {
+            if (f_seen) {
+                printf("Cannot have 2 fathers.\n");
+                exit(1);
+            }
+            int father = internName(node, node_len, 0);
+            people.father[crnt] = father;
+            linkParent(crnt, father);
+            f_seen = 1;
+        } else if (kind == 'M') {
+            if (m_seen) {
+                printf("Cannot have 2 mothers.\n");
+                exit(1);
+            }
+            int mother = internName(node, node_len, 0);
+            people.mother[crnt] = mother;
+            linkParent(crnt, mother);
+            m_seen = 1;
+        } else {
+            printf("Invalid input.\n");
+            exit(1);
+        }
+    }
+    if (first) {
+        printf("File needs to start with 'VARDS'.\n");
+        exit(1);
+    }
+}
+
+// ------------------------------------------------------------------
+// SNAPSHOTS: -s file saves what a run worked out, -q file answers questions from it
+// ------------------------------------------------------------------
+
+// A snapshot is this header and then, in native byte order and type sizes (it is only
+// meant to be read back on the same kind of machine), every person's
+//   size_t name offset, int name length, father, mother, generation, family
+// then the name index (index_cap ints, the same open addressing as names) and the
+// names back to back. It is mapped and used as it is, nothing is parsed or rebuilt.
+#define SNAPSHOT_MAGIC "MDKOKS1"
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    size_t count;
+    size_t index_cap;
+    size_t text_size;
+} SnapshotHeader;
+
+size_t snapshotSize(size_t count, size_t index_cap, size_t text_size)
+{
+    return sizeof(SnapshotHeader) + count * (sizeof(size_t) + 5 * sizeof(int)) + index_cap * sizeof(int) + text_size;
+}
+
+// layers are relative to some member of the family; saved as the generation counted
+// from the oldest one in the family, which is 0 and printed first
+void saveSnapshot(const char* path, int slots)
+{
+    int count = people.count;
+    int* oldest = allocOrExit(slots, sizeof(int));
+    char* seen = allocOrExit(slots, 1);
+    for (int id = 0; id < count; id++) {
+        int f = people.family[id];
+        if (!seen[f] || people.layer[id] > oldest[f]) {
+            oldest[f] = people.layer[id];
+            seen[f] = 1;
+        }
+    }
+    size_t* offset = allocOrExit(count, sizeof(size_t));
+    int* generation = allocOrExit(count, sizeof(int));
+    SnapshotHeader h = {SNAPSHOT_MAGIC, count, names.cap, 0};
+    for (int id = 0; id < count; id++) {
+        offset[id] = h.text_size;
+        h.text_size += people.len[id];
+        generation[id] = oldest[people.family[id]] - people.layer[id];
+    }
+
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        printf("Not able to write %s.\n", path);
+        exit(1);
+    }
+    fwrite(&h, sizeof(h), 1, out);
+    fwrite(offset, sizeof(size_t), count, out);
+    fwrite(people.len, sizeof(int), count, out);
+    fwrite(people.father, sizeof(int), count, out);
+    fwrite(people.mother, sizeof(int), count, out);
+    fwrite(generation, sizeof(int), count, out);
+    fwrite(people.family, sizeof(int), count, out);
+    fwrite(names.slots, sizeof(int), names.cap, out);
+    for (int id = 0; id < count; id++) {
+        fwrite(nameOf(id), 1, people.len[id], out);
+    }
+    if (fclose(out) != 0) {
+        printf("Not able to write %s.\n", path);
+        exit(1);
+    }
+    free(oldest);
+    free(seen);
+    free(offset);
+    free(generation);
+}
+
+// every name inside the text, every parent and family a valid id or -1 (family never -1),
+// every index slot empty or a valid id and at least one of them empty, so that
+// indexSlot() stops; anything else would read outside the mapping
+int snapshotValid(const SnapshotHeader* h)
+{
+    int count = people.count;
+    for (int id = 0; id < count; id++) {
+        if (people.len[id] < 0 || people.name[id] > h->text_size || (size_t)people.len[id] > h->text_size - people.name[id]
+            || people.father[id] < -1 || people.father[id] >= count || people.mother[id] < -1 || people.mother[id] >= count
+            || people.family[id] < 0 || people.family[id] >= count) {
+            return 0;
+        }
+    }
+    size_t empty = 0;
+    for (size_t i = 0; i < names.cap; i++) {
+        if (names.slots[i] < -1 || names.slots[i] >= count) {
+            return 0;
+        }
+        empty += names.slots[i] == -1;
+    }
+    return empty > 0;
+}
+
+// map a snapshot and point people and names into it; people.layer holds the generations
+void loadSnapshot(const char* path)
+{
+    FILE* in = fopen(path, "rb");
+    struct stat st;
+    if (!in || fstat(fileno(in), &st) != 0) {
+        printf("Not able to open %s.\n", path);
+        exit(1);
+    }
+    const char* map = NULL;
+    if ((size_t)st.st_size >= sizeof(SnapshotHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+    }
+    fclose(in); // the mapping stays
+    const SnapshotHeader* h = (const SnapshotHeader*)map;
+    if (!map || map == MAP_FAILED || memcmp(h->magic, SNAPSHOT_MAGIC, 8) != 0
+        || h->count > 0x7fffffff || (h->index_cap & (h->index_cap - 1)) != 0 || h->index_cap <= h->count || h->index_cap > (size_t)st.st_size
+        || h->text_size > (size_t)st.st_size || snapshotSize(h->count, h->index_cap, h->text_size) != (size_t)st.st_size) {
+        printf("%s is not a snapshot.\n", path);
+        exit(1);
+    }
+    const char* p = map + sizeof(SnapshotHeader);
+    people.count = h->count;
+    people.name = (size_t*)p;
+    p += h->count * sizeof(size_t);
+    int** arrays[] = {&people.len, &people.father, &people.mother, &people.layer, &people.family};
+    for (int i = 0; i < 5; i++) {
+        *arrays[i] = (int*)p;
+        p += h->count * sizeof(int);
+    }
+    names.slots = (int*)p;
+    names.cap = h->index_cap;
+    p += h->index_cap * sizeof(int);
+    people.text = p;
+    if (!snapshotValid(h)) {
+        printf("%s is not a snapshot.\n", path);
+        exit(1);
+    }
+}
+
+int isWord(const char* word, int len, const char* keyword)
+{
+    return (size_t)len == strlen(keyword) && memcmp(word, keyword, len) == 0;
+}
+
+// 1 and the number in *levels if word is a whole number from 0 to INT_MAX, otherwise 0
+int parseLevels(const char* word, int len, int* levels)
+{
+    char* stop;
+    errno = 0;
+    long n = strtol(word, &stop, 10);
+    if (stop != word + len || errno == ERANGE || n < 0 || n > INT_MAX) {
+        return 0;
+    }
+    *levels = (int)n;
+    return 1;
+}
+
+// id of the person with this name, -1 if there is nobody
+int findName(const char* name, int len)
+{
+    return names.slots[indexSlot(name, len)];
+}
+
+// ancestors of id up to levels generations back, nearest first, mother's side before
+// father's; someone reachable along two lines is listed once. seen and queue hold
+// an int per person, stamp is new for every query so seen never has to be cleared.
+void printAncestors(int id, int levels, int* seen, int* queue, int stamp)
+{
+    int head = 0;
+    int tail = 0;
+    queue[tail++] = id;
+    seen[id] = stamp;
+    for (int level = 1; level <= levels && head < tail; level++) {
+        int end = tail;
+        for (; head < end; head++) {
+            int parents[2] = {people.mother[queue[head]], people.father[queue[head]]};
+            for (int i = 0; i < 2; i++) {
+                int a = parents[i];
+                if (a >= 0 && seen[a] != stamp) {
+                    seen[a] = stamp;
+                    queue[tail++] = a;
+                    printf("%d %.*s\n", level, people.len[a], nameOf(a));
+                }
+            }
+        }
+    }
+}
+
+// one question per line on fptr:
+//   generation X   - X's generation, 0 is the oldest in X's family
+//   ancestors X k  - X's ancestors up to k generations back, "level name" per line;
+//                    k is a whole number from 0 to INT_MAX
+//   family X Y     - yes if X and Y are in the same family, otherwise no
+// Every answer ends with an empty line.
+void answerQueries(FILE* fptr)
+{
+    int* seen = allocOrExit(people.count, sizeof(int)); // untouched pages cost nothing until used
+    int* queue = allocOrExit(people.count, sizeof(int));
+    int stamp = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, fptr)) >= 0) {
+        const char* p = line;
+        const char* end = line + line_len;
+        const char* word[4]; // one more than a query has, to tell when there are too many
+        int len[4];
+        int words = 0;
+        while (words < 4 && (word[words] = nextWord(&p, end, &len[words]))) {
+            words++;
+        }
+        if (words == 0) {
+            continue;
+        }
+        // the query, and how many names follow its keyword
+        char kind = 0;
+        int wanted = 0;
+        int levels = 0;
+        if (words == 2 && isWord(word[0], len[0], "generation")) {
+            kind = 'g';
+            wanted = 1;
+        } else if (words == 3 && isWord(word[0], len[0], "ancestors") && parseLevels(word[2], len[2], &levels)) {
+            kind = 'a';
+            wanted = 1;
+        } else if (words == 3 && isWord(word[0], len[0], "family")) {
+            kind = 'f';
+            wanted = 2;
+        }
+        int ids[2] = {-1, -1};
+        for (int i = 0; i < wanted && kind; i++) {
+            ids[i] = findName(word[i + 1], len[i + 1]);
+            if (ids[i] < 0) {
+                printf("Unknown name %.*s.\n", len[i + 1], word[i + 1]);
+                kind = '?';
+            }
+        }
+        if (kind == 'g') {
+            printf("%d\n", people.layer[ids[0]]);
+        } else if (kind == 'a') {
+            printAncestors(ids[0], levels, seen, queue, ++stamp);
+        } else if (kind == 'f') {
+            printf("%s\n", people.family[ids[0]] == people.family[ids[1]] ? "yes" : "no");
+        } else if (!kind) {
+            printf("Invalid query.\n");
+        }
+        printf("\n");
+    }
+    free(line);
+    free(seen);
+    free(queue);
+}
+
+int main(int argc, char** argv)
+{
+    // mdKoks [-j threads] [-s snapshot] < input
+    //   -j: the graphs are sorted on that many threads
+    //   -s: also save a snapshot for -q
+    // mdKoks -q snapshot < queries
+    int threads = 1;
+    const char* save = NULL;
+    const char* query = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-s") == 0) {
+            save = argv[++i];
+        } else if (i + 1 < argc && strcmp(argv[i], "-q") == 0) {
+            query = argv[++i];
+        } else {
+            threads = 0;
+            break;
+        }
+    }
+    if (threads < 1 || (query && (save || argc != 3))) {
+        printf("Usage: %s [-j threads] [-s snapshot] < input\n       %s -q snapshot < queries\n", argv[0], argv[0]);
+        return 1;
+    }
+    if (query) {
+        loadSnapshot(query);
+        answerQueries(stdin);
+        return 0;
+    }
+
+    // ------------------------------------------------------------------
+    // POPULATE THE NODE GRAPH AND KEEP A LIST OF EXISTING NODES
+    // ------------------------------------------------------------------
+
+    FILE* fptr = stdin;
+    if(fptr == NULL) {
+        printf("Not able to open the file.\n");
+        return 1;
+    }
+    populate_graph(fptr);
+    int count = people.count;
+
+    // ------------------------------------------------------------------
+    // WALK THE NODES LIST AND SPLIT GRAPHS (GENERATIONS ARE CHECKED WHILE READING)
+    // ------------------------------------------------------------------
+
+    createFamilies(count);
+    int* stack = allocOrExit(2 * (size_t)count + 1, sizeof(int));
+    int slots = 0;
+    for (int id = 0; id < count; id++) {
+        // a declared node that no earlier graph has reached starts a new one
+        if (people.declared[id] && !fam.placed[id]) {
+            buildFamily(id, slots++, stack);
+        }
+    }
+    free(stack);
+
+    // family of everyone, straight from the union-find
+    people.layer = allocOrExit(count, sizeof(int));
+    people.family = allocOrExit(count, sizeof(int));
+    for (int id = 0; id < count; id++) {
+        people.family[id] = fam.slot[findFamily(id)];
+    }
+
+    // ------------------------------------------------------------------
+    // PRINT THE GRAPHS IN DESCENDING ORDER OF LAYERS
+    // ------------------------------------------------------------------
+
+    // collect the graphs in a single pass: every root is one, in the order of its slot
+    int* by_slot = allocOrExit(slots, sizeof(int));
+    for (int i = 0; i < slots; i++) {
+        by_slot[i] = -1;
+    }
+    for (int id = 0; id < count; id++) {
+        if (fam.parent[id] == id && fam.placed[id]) {
+            by_slot[people.family[id]] = id;
+        }
+    }
+    int n = 0;
+    for (int s = 0; s < slots; s++) {
+        if (by_slot[s] >= 0) {
+            by_slot[n++] = by_slot[s]; // the rest were merged into a later graph
+        }
+    }
+
+    if (threads > 1) {
+        printFamiliesParallel(by_slot, n, threads);
+    } else {
+        int* arr = allocOrExit(count, sizeof(int));
+        int* sorted = allocOrExit(count, sizeof(int));
+        for (int s = 0; s < n; s++) {
+            int c = layerFamily(by_slot[s], arr, sorted);
+            for (int i = 0; i < c; i++) {
+                printf("%.*s\n", people.len[sorted[i]], nameOf(sorted[i]));
+            }
+            printf("\n");
+        }
+        free(arr);
+        free(sorted);
+    }
+    free(by_slot);
+
+    if (save) {
+        saveSnapshot(save, slots);
+    }
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+/*
+md_bench - repeats an md_mem tool, summarizes the runs and compares them
+against a saved baseline.
+
+    ./md_bench [-k runs] [-c cpu] [-t threshold_%] [-s save.csv] [-b baseline.csv] [-v] -- ./md_mem probe
+
+Each run executes the tool with "-f csv" (see md_out.h) pinned to one CPU
+with sched_setaffinity(); the mask is inherited across fork() and exec(),
+so the tool's own test children stay on that CPU too and do not migrate
+between runs. Every probe gets mean, median and standard deviation over
+the runs.
+
+-s writes those statistics to a file, -b reads such a file back and
+compares medians. A probe only counts as regressed when it moved in its
+'worse' direction by more than the noise band, which is the larger of
+the threshold (default 5 %) and two baseline standard deviations. A
+probe whose baseline median is 0 has no relative change; it is compared
+in absolute terms against two baseline standard deviations, and the change
+column shows the difference instead of a percentage. A probe in the
+baseline that the tool no longer prints is listed as "(gone)" and fails
+like a regression. Any regression makes md_bench exit with 2, so a kernel
+or glibc upgrade can be gated on:
+
+    ./md_bench -k 10 -s before.csv -- ./md_mem_100_cleaner
+    (upgrade)
+    ./md_bench -k 10 -b before.csv -- ./md_mem_100_cleaner || echo slower
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>       /* open */
+#include <math.h>        /* sqrt, fabs */
+#include <sched.h>       /* sched_setaffinity */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>    /* waitpid */
+#include <unistd.h>      /* fork, execvp, pipe */
+
+#define MAX_METRICS 512
+
+typedef struct Metric {
+    char tool[64];
+    char probe[96];
+    char unit[16];
+    char better[8];
+    double *v;       /* one value per run */
+    int n, cap;
+    double mean, median, stddev;
+    /* from the baseline file, if any */
+    int has_base;
+    double base_median, base_stddev;
+} Metric;
+
+static Metric metrics[MAX_METRICS];
+static int nmetrics;
+
+static Metric *find_metric(const char *tool, const char *probe)
+{
+    for (int i = 0; i < nmetrics; i++) {
+        if (strcmp(metrics[i].tool, tool) == 0 && strcmp(metrics[i].probe, probe) == 0) {
+            return &metrics[i];
+        }
+    }
+    if (nmetrics == MAX_METRICS) {
+        return NULL;
+    }
+    Metric *m = &metrics[nmetrics++];
+    snprintf(m->tool, sizeof(m->tool), "%s", tool);
+    snprintf(m->probe, sizeof(m->probe), "%s", probe);
+    return m;
+}
+
+static void add_value(Metric *m, double x)
+{
+    if (m->n == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 16;
+        m->v = realloc(m->v, (size_t)m->cap * sizeof(double));
+        if (!m->v) { perror("realloc"); exit(1); }
+    }
+    m->v[m->n++] = x;
+}
+
+/* Splits a CSV line in place; fields never contain commas. Returns the field count. */
+static int split(char *line, char **field, int max)
+{
+    int n = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (char *s = line; n < max; ) {
+        field[n++] = s;
+        s = strchr(s, ',');
+        if (!s) break;
+        *s++ = '\0';
+    }
+    return n;
+}
+
+/* One run of the tool; returns 0 when it exited cleanly. */
+static int run_once(char **argv, int cpu, int verbose)
+{
+    int fd[2];
+    if (pipe(fd) < 0) { perror("pipe"); exit(1); }
+
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) < 0) { perror("sched_setaffinity"); _exit(127); }
+        }
+        dup2(fd[1], STDOUT_FILENO);
+        close(fd[0]);
+        close(fd[1]);
+        if (!verbose) { /* the human readable text goes to stderr in csv mode */
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    close(fd[1]);
+    FILE *in = fdopen(fd[0], "r");
+    char line[512];
+    while (fgets(line, sizeof(line), in)) {
+        char *f[5];
+        if (split(line, f, 5) != 5 || strcmp(f[0], "tool") == 0) {
+            continue; /* header */
+        }
+        Metric *m = find_metric(f[0], f[1]);
+        if (!m) continue;
+        snprintf(m->unit, sizeof(m->unit), "%s", f[3]);
+        snprintf(m->better, sizeof(m->better), "%s", f[4]);
+        add_value(m, atof(f[2]));
+    }
+    fclose(in);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void summarize(Metric *m)
+{
+    double sum = 0;
+    for (int i = 0; i < m->n; i++) sum += m->v[i];
+    m->mean = sum / m->n;
+
+    double sq = 0;
+    for (int i = 0; i < m->n; i++) sq += (m->v[i] - m->mean) * (m->v[i] - m->mean);
+    m->stddev = m->n > 1 ? sqrt(sq / (m->n - 1)) : 0.0;
+
+    qsort(m->v, (size_t)m->n, sizeof(double), cmp_double);
+    m->median = m->n % 2 ? m->v[m->n / 2] : (m->v[m->n / 2 - 1] + m->v[m->n / 2]) / 2;
+}
+
+/* baseline / save file: tool,probe,unit,better,runs,mean,median,stddev */
+static int load_baseline(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) { perror(path); return -1; }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *fl[8];
+        if (split(line, fl, 8) != 8 || strcmp(fl[0], "tool") == 0) {
+            continue;
+        }
+        Metric *m = find_metric(fl[0], fl[1]); /* a new one has no runs: the probe is gone */
+        if (!m) {
+            continue;
+        }
+        if (m->n == 0) {
+            snprintf(m->unit, sizeof(m->unit), "%s", fl[2]);
+            snprintf(m->better, sizeof(m->better), "%s", fl[3]);
+        }
+        m->has_base = 1;
+        m->base_median = atof(fl[6]);
+        m->base_stddev = atof(fl[7]);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int save(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return -1; }
+    fprintf(f, "tool,probe,unit,better,runs,mean,median,stddev\n");
+    for (int i = 0; i < nmetrics; i++) {
+        Metric *m = &metrics[i];
+        if (m->n == 0) continue; /* only in the baseline */
+        fprintf(f, "%s,%s,%s,%s,%d,%.9g,%.9g,%.9g\n", m->tool, m->probe, m->unit, m->better, m->n, m->mean, m->median, m->stddev);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void usage(const char *self)
+{
+    fprintf(stderr, "usage: %s [-k runs] [-c cpu] [-t threshold_%%] [-s save.csv] [-b baseline.csv] [-v] -- tool [args]\n", self);
+    exit(1);
+}
+
+/* ------------------------------------------------------------------ */
+int main(int argc, char **argv)
+{
+    int runs = 5, cpu = 0, verbose = 0;
+    double threshold = 5.0;
+    const char *save_path = NULL, *base_path = NULL;
+
+    int i = 1;
+    for (; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "-v") == 0) { verbose = 1; continue; }
+        if (i + 1 >= argc) usage(argv[0]);
+        if (strcmp(argv[i], "-k") == 0) runs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-c") == 0) cpu = atoi(argv[++i]); /* -1 = do not pin */
+        else if (strcmp(argv[i], "-t") == 0) threshold = atof(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0) save_path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0) base_path = argv[++i];
+        else usage(argv[0]);
+    }
+    if (i + 1 >= argc || runs < 1 || threshold < 0) usage(argv[0]);
+
+    /* tool argv with "-f csv" right after the program name */
+    int tool_argc = argc - i - 1;
+    char **tool = calloc((size_t)tool_argc + 3, sizeof(char *));
+    tool[0] = argv[i + 1];
+    tool[1] = "-f";
+    tool[2] = "csv";
+    for (int j = 1; j < tool_argc; j++) tool[j + 2] = argv[i + 1 + j];
+
+    for (int r = 0; r < runs; r++) {
+        fprintf(stderr, "run %d/%d\r", r + 1, runs);
+        if (run_once(tool, cpu, verbose) < 0) {
+            fprintf(stderr, "\n%s failed on run %d\n", tool[0], r + 1);
+            return 1;
+        }
+    }
+    fprintf(stderr, "\n");
+    if (nmetrics == 0) {
+        fprintf(stderr, "%s printed no records\n", tool[0]);
+        return 1;
+    }
+
+    int measured = nmetrics; /* load_baseline() appends the probes that are gone */
+    for (int m = 0; m < measured; m++) summarize(&metrics[m]);
+    if (base_path && load_baseline(base_path) < 0) return 1;
+    if (save_path && save(save_path) < 0) return 1;
+
+    int regressions = 0, gone = 0;
+    printf("%-32s %-8s %14s %14s %12s", "probe", "unit", "mean", "median", "stddev");
+    if (base_path) printf(" %14s %9s", "baseline", "change");
+    printf("\n");
+
+    for (int m = 0; m < nmetrics; m++) {
+        Metric *x = &metrics[m];
+        if (x->n == 0) {
+            printf("%-32s %-8s %14s %14s %12s %14.6g %9s  REGRESSION\n", x->probe, x->unit, "-", "-", "-", x->base_median, "(gone)");
+            gone++;
+            continue;
+        }
+        printf("%-32s %-8s %14.6g %14.6g %12.4g", x->probe, x->unit, x->mean, x->median, x->stddev);
+        if (base_path && x->has_base) {
+            /* relative to the baseline, or the plain difference when the baseline is 0 */
+            double base = fabs(x->base_median);
+            double change = base > 0 ? (x->median - x->base_median) / base : x->median;
+            double noise = base > 0 ? threshold / 100 : 0.0;
+            if (2 * x->base_stddev / (base > 0 ? base : 1) > noise) {
+                noise = 2 * x->base_stddev / (base > 0 ? base : 1);
+            }
+            int worse = strcmp(x->better, "lower") == 0 ? change > 0
+                      : strcmp(x->better, "higher") == 0 ? change < 0 : 0;
+            int significant = fabs(change) > noise && strcmp(x->better, "none") != 0;
+
+            if (base > 0) {
+                printf(" %14.6g %+8.1f%%", x->base_median, 100 * change);
+            } else {
+                printf(" %14.6g %+9.3g", x->base_median, change);
+            }
+            if (significant) {
+                printf("  %s", worse ? "REGRESSION" : "improved");
+                regressions += worse;
+            }
+        } else if (base_path) {
+            printf(" %14s", "(new)");
+        }
+        printf("\n");
+    }
+
+    if (regressions || gone) {
+        printf("\n%d regression(s) outside the noise band, %d probe(s) gone\n", regressions, gone);
+        return 2;
+    }
+    return 0;
+}
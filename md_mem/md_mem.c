@@ -4,6 +4,18 @@ md_mem:
 Finds the maximum amount of memory that can be reserved using
 malloc(), mmap(), and sbrk(), one megabyte at a time.
 
+    ./md_mem                      1 MB at a time (slow, millions of calls)
+    ./md_mem probe [precision_KB] exponential + binary search (milliseconds)
+    ./md_mem touch [limit_MB]     write every page, measure first-touch cost
+    ./md_mem threads [max_threads] [max_size] [alloc_pct] [ms]
+                                  malloc/free contention, 1..max_threads
+    ./md_mem release [size_MB]    cost of giving memory back to the kernel
+
+Add "-f csv" or "-f json" to any of them for machine readable records
+(see md_out.h), and use md_bench to repeat and compare runs.
+
+Build with -pthread (see Makefile).
+
 We dont write to the allocated memory - we are measuring the
 virtual address space limit, not how much physical RAM is present.
 
@@ -27,29 +39,142 @@ The result is passed back via a MAP_SHARED region - a page of
 memory that both parent and child map to the same physical address,
 so writes in the child are visible to the parent even if the child
 is killed before it can exit().
+
+PROBE MODE:
+
+	Reserving 1 MB at a time needs millions of calls on a 47-bit address
+	space. The probe instead asks "does one reservation of N bytes fit?":
+	it doubles N until the first failure, then binary searches between the
+	last success and that failure down to the requested precision.
+	The address space is not one big hole though (libraries, stack, heap),
+	so the largest fit is kept, the same size is reserved again until it
+	stops fitting, and the search repeats for the next smaller hole.
+	That gives the same total as the 1 MB loop in a few hundred calls.
+
+	mmap() uses MAP_NORESERVE, otherwise the kernel's overcommit heuristic
+	refuses any single mapping larger than RAM + swap, which the 1 MB loop
+	never runs into. malloc() has no such flag, so its chunks stay capped
+	at RAM + swap and it simply takes more (cheap) rounds.
+
+TOUCH MODE:
+
+	The opposite question: what does it cost to actually use the memory?
+	Reserves 64 MB at a time and writes one byte to every page, so every
+	page takes a first-touch fault and gets physical RAM behind it. Runs
+	until the limit, an mmap() failure, or the OOM killer, in four flavours:
+
+	plain    - fault each page on first write
+	populate - MAP_POPULATE, the kernel faults everything inside mmap()
+	huge     - MADV_HUGEPAGE, one fault per 2 MB transparent huge page
+	willneed - MADV_WILLNEED first (only does read-ahead for file/swap
+	           backed pages, so on fresh anonymous memory it shows ~plain)
+
+	Fault counts come from getrusage() and are written to the shared page
+	after every chunk, so a child killed by the OOM killer still reports
+	how far it got.
+
+THREADS MODE:
+
+	Every other mode has one allocating thread. Here the child starts N
+	threads that each run the same random malloc/free loop as the PD-Heap
+	timing test (64 slots per thread, sizes 1..max_size, alloc_pct % of
+	the steps try to allocate) for a fixed time, for N = 1, 2, 4 .. max.
+	Each thread's count of successful mallocs and frees (a malloc that
+	returns NULL is not counted) lands in the shared page, giving ops/s and
+	fairness (Jain's index: 1.0 when every thread got the same share).
+
+	glibc hands threads separate arenas (up to 8 * cores), so small blocks
+	mostly contend on arena mutexes. Blocks above the mmap threshold
+	(128 KB) go to mmap()/munmap(), which serialize on the process-wide
+	mmap lock instead. Both show up as voluntary context switches and
+	system time; arena count and footprint come from malloc_info() and
+	mallinfo2(), and malloc_stats() prints the largest run per arena to stderr.
+
+RELEASE MODE:
+
+	Every other mode only acquires. Here each child touches size_MB, frees
+	it one way, and reports the latency of the release call(s) and how long
+	it takes the resident set (sampled from /proc/self/statm) to drop by
+	at least 90 % of what was touched:
+
+	free large  - one malloc() above the mmap threshold, free() = munmap
+	free small  - 1 KB blocks from the heap, all freed but the last one,
+	              which pins the heap top so glibc cannot shrink it
+	malloc_trim - the same heap, then malloc_trim(0) madvises the holes
+	munmap      - plain mmap()/munmap()
+	DONTNEED    - madvise(MADV_DONTNEED), pages dropped immediately
+	FREE        - madvise(MADV_FREE), pages only reclaimed under memory
+	              pressure, so RSS usually does not move at all
 */
 
 #include <stdio.h>
-#include <stdlib.h>      /* malloc */
-#include <sys/mman.h>    /* mmap */
+#include <signal.h>      /* SIGKILL */
+#include <stdint.h>      /* intptr_t, int64_t */
+#include <stdlib.h>      /* malloc, atol */
+#include <malloc.h>      /* mallinfo2, malloc_info, malloc_stats */
+#include <pthread.h>
+#include "md_out.h"      /* out_value */
+#include <string.h>      /* strcmp */
+#include <time.h>        /* clock_gettime */
+#include <fcntl.h>       /* open */
+#include <sys/mman.h>    /* mmap, madvise */
+#include <sys/resource.h> /* getrusage */
 #include <sys/wait.h>    /* waitpid */
 #include <unistd.h>      /* fork, sbrk */
 
+#define KB 1024
 #define MB (1024 * 1024)
+#define PROBE_CAP ((size_t)1 << 62) /* larger than any real address space, small enough to double without overflow */
+#define TOUCH_CHUNK (64 * MB)
+#define MAX_THREADS 256
+#define SMALL_BLOCK 1024
+#define RELEASE_WINDOW_NS 200000000LL /* stop watching RSS after 200 ms */
+#define RELEASE_SAMPLE_NS 100000L     /* 100 us between statm samples */
 
 /*
-One shared page used to pass a count from child back to parent.
+One shared page used to pass results from child back to parent.
 Initialized before fork() so both processes map the same page.
+count is what every test reports; the rest is filled in by the modes that need it.
 */
+typedef struct Shared {
+    long count;
+    long minflt;      /* page faults served without I/O */
+    long majflt;      /* page faults that needed I/O */
+    int64_t time_ns;
+    long rss_kb;      /* peak resident set size */
+    int end;          /* why the child stopped, see END_* */
+    /* threads mode */
+    int started;      /* threads that pthread_create() actually started */
+    long ops[MAX_THREADS]; /* successful mallocs and frees */
+    long arenas;
+    long sys_bytes;   /* heap obtained from the kernel, brk + mmap */
+    long mmapped;     /* blocks served by their own mmap() */
+    long nvcsw;       /* voluntary context switches - blocked on a lock */
+    int64_t stime_ns;
+    /* release mode */
+    long calls;
+    int64_t call_ns;  /* total time inside the release call(s) */
+    long rss_before_kb;
+    long rss_after_kb;
+    int64_t drop_ns;  /* time until RSS dropped by 90 %, -1 if it never did */
+} Shared;
+
+#define END_KILLED 0  /* never set by the child - it was killed before it could */
+#define END_FAILED 1
+#define END_LIMIT  2
+
+Shared *g_shared;
 long *g_count; /* usually would make this volatile, but since waitpid is being used it's fine */
+int g_status;  /* waitpid() status of the last child */
 
 void init_shared(void)
 {
 	/* PROT_READ/WRITE for those rights; MAP_SHARED to work between processes 
 	; MAP_ANONYMOUS to ignore fd / not be bakced by a file and also be filled with 0s */
-    void *p = mmap(NULL, sizeof(long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    void *p = mmap(NULL, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
     if (p == MAP_FAILED) { perror("mmap"); exit(1); }
-    g_count = (long *)p;
+    g_shared = (Shared *)p;
+    g_count = &g_shared->count;
 }
 
 /*
@@ -57,8 +182,8 @@ Forks fn() into a child, waits for it, returns the count.
 */
 long run_in_child(void (*fn)(void)) /* (*fn) makes fn a function pointer, not a void pointer; the voids specify no return value and no arguments */
 {
-    *g_count = 0;
-    fflush(stdout);
+    memset(g_shared, 0, sizeof(Shared));
+    fflush(NULL); /* every stream, the -f record stream would otherwise be written twice too */
 
     pid_t pid = fork();              /* duplicate this process */
     if (pid < 0) { perror("fork"); exit(1); }
@@ -69,8 +194,7 @@ long run_in_child(void (*fn)(void)) /* (*fn) makes fn a function pointer, not a
     }
 
     /* parent: wait for the child to finish or be killed */
-    int status; /* status allows for checking how the child exited, but it's not really necessary */
-    waitpid(pid, &status, 0);
+    waitpid(pid, &g_status, 0); /* g_status tells the touch mode whether the OOM killer got there first */
 
     return (long)*g_count;
 }
@@ -98,20 +222,588 @@ void child_sbrk(void)
 }
 
 /* ------------------------------------------------------------------ */
-int main(void)
+/*
+Reservation backends for the probe. reserve() returns NULL on failure,
+release() hands a successful test reservation back before the next one.
+*/
+typedef struct Backend {
+    const char *name;
+    void *(*reserve)(size_t size);
+    void (*release)(void *p, size_t size);
+} Backend;
+
+static void *reserve_malloc(size_t size) { return malloc(size); }
+static void release_malloc(void *p, size_t size) { (void)size; free(p); }
+
+static void *reserve_mmap(size_t size)
 {
-    printf("Maximum reservable memory (1 MB at a time, separate address spaces for each function):\n\n");
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+static void release_mmap(void *p, size_t size) { munmap(p, size); }
 
-    init_shared();
+static void *reserve_sbrk(size_t size)
+{
+    void *p = sbrk((intptr_t)size);
+    return p == (void *)-1 ? NULL : p;
+}
+static void release_sbrk(void *p, size_t size) { (void)p; sbrk(-(intptr_t)size); }
+
+static const Backend backends[] = {
+    { "malloc", reserve_malloc, release_malloc },
+    { "mmap",   reserve_mmap,   release_mmap   },
+    { "sbrk",   reserve_sbrk,   release_sbrk   },
+};
+
+/* set by the parent before fork(), the child inherits them */
+static const Backend *g_backend;
+static size_t g_precision = MB;
+
+/* Does one reservation of 'size' bytes fit? The reservation is given back either way. */
+static int fits(size_t size)
+{
+    void *p = g_backend->reserve(size);
+    if (!p) {
+        return 0;
+    }
+    g_backend->release(p, size);
+    return 1;
+}
+
+/*
+Largest multiple of g_precision, at most 'cap', that can be reserved in one call.
+Double until the first failure, then binary search between the last success (lo)
+and the first failure (hi). Returns 0 if not even g_precision fits.
+*/
+static size_t largest_fit(size_t cap)
+{
+    size_t lo = 0;
+    size_t hi = cap + g_precision; /* first size known (or assumed) to fail */
+    size_t s;
+
+    for (s = g_precision; s <= cap; s *= 2) {
+        if (!fits(s)) { hi = s; break; }
+        lo = s;
+    }
+    if (s > cap && lo < cap) { /* ran past cap without failing, cap itself is the last candidate */
+        if (fits(cap)) return cap;
+        hi = cap;
+    }
+
+    while (hi - lo > g_precision) {
+        size_t mid = lo + (hi - lo) / 2 / g_precision * g_precision;
+        if (mid == lo) mid += g_precision;
+        if (fits(mid)) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* g_count holds bytes here, updated after every kept chunk so a killed child still reports */
+void child_probe(void)
+{
+    size_t cap = PROBE_CAP / g_precision * g_precision;
+    size_t chunk;
+
+    while ((chunk = largest_fit(cap)) > 0) {
+        /* holes of the same size are common (e.g. RAM + swap for malloc), keep taking them */
+        while (g_backend->reserve(chunk)) {
+            *g_count += (long)chunk;
+        }
+        cap = chunk - g_precision; /* whatever is left is strictly smaller */
+    }
+}
+
+int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int run_probe(size_t precision)
+{
+    printf("Maximum reservable memory (exponential + binary search, precision %zu KB):\n\n", precision / KB);
+
+    g_precision = precision;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        g_backend = &backends[i];
+        printf("%-6s : ", g_backend->name); fflush(stdout);
+
+        int64_t t0 = now_ns();
+        long bytes = run_in_child(child_probe);
+        int64_t t1 = now_ns();
+        printf("%ld MB (%.3f ms)\n", bytes / MB, (t1 - t0) / 1e6);
+
+        char key[64];
+        snprintf(key, sizeof(key), "probe.%s.mb", g_backend->name);
+        out_value(key, (double)(bytes / MB), "MB", BETTER_HIGHER);
+        snprintf(key, sizeof(key), "probe.%s.ms", g_backend->name);
+        out_value(key, (t1 - t0) / 1e6, "ms", BETTER_LOWER);
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* set by the parent before fork(), like g_backend */
+static int g_touch_mode;
+static long g_touch_limit_mb; /* 0 = until failure */
+
+#define TOUCH_PLAIN    0
+#define TOUCH_POPULATE 1
+#define TOUCH_HUGE     2
+#define TOUCH_WILLNEED 3
+
+static const char *touch_names[] = { "plain", "populate", "huge", "willneed" };
+
+/* Map one chunk the way the current mode wants it, NULL on failure. */
+static unsigned char *touch_map(size_t size)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (g_touch_mode == TOUCH_POPULATE) {
+        flags |= MAP_POPULATE;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    if (g_touch_mode == TOUCH_HUGE) {
+        madvise(p, size, MADV_HUGEPAGE);
+    } else if (g_touch_mode == TOUCH_WILLNEED) {
+        madvise(p, size, MADV_WILLNEED);
+    }
+    return (unsigned char *)p;
+}
+
+void child_touch(void)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct rusage ru0, ru;
+    getrusage(RUSAGE_SELF, &ru0);
+
+    while (g_touch_limit_mb == 0 || *g_count < g_touch_limit_mb) {
+        int64_t t0 = now_ns();
+        unsigned char *p = touch_map(TOUCH_CHUNK);
+        if (!p) {
+            g_shared->end = END_FAILED;
+            return;
+        }
+        for (size_t off = 0; off < TOUCH_CHUNK; off += (size_t)page) {
+            p[off] = 1; /* first write to the page - this is the fault being measured */
+        }
+        int64_t t1 = now_ns();
+
+        /* publish after every chunk; the next one may never finish */
+        getrusage(RUSAGE_SELF, &ru);
+        g_shared->time_ns += t1 - t0;
+        g_shared->minflt = ru.ru_minflt - ru0.ru_minflt;
+        g_shared->majflt = ru.ru_majflt - ru0.ru_majflt;
+        g_shared->rss_kb = ru.ru_maxrss;
+        *g_count += TOUCH_CHUNK / MB;
+    }
+    g_shared->end = END_LIMIT;
+}
+
+int run_touch(long limit_mb)
+{
+    printf("First-touch cost, %d MB chunks, ", TOUCH_CHUNK / MB);
+    if (limit_mb) printf("up to %ld MB:\n\n", limit_mb);
+    else printf("until failure:\n\n");
+
+    g_touch_limit_mb = limit_mb;
+    for (g_touch_mode = TOUCH_PLAIN; g_touch_mode <= TOUCH_WILLNEED; g_touch_mode++) {
+        printf("%-8s : ", touch_names[g_touch_mode]); fflush(stdout);
+
+        long mb = run_in_child(child_touch);
+        double gib = mb / 1024.0;
+        printf("%ld MB, %ld minor / %ld major faults, %.3f s/GiB, RSS %ld MB",
+               mb, g_shared->minflt, g_shared->majflt,
+               gib > 0 ? g_shared->time_ns / 1e9 / gib : 0.0, g_shared->rss_kb / KB);
+
+        if (WIFSIGNALED(g_status)) {
+            printf(" (killed by signal %d%s)\n", WTERMSIG(g_status), WTERMSIG(g_status) == SIGKILL ? ", OOM killer" : "");
+        } else {
+            printf(" (%s)\n", g_shared->end == END_LIMIT ? "limit reached" : "mmap failed");
+        }
+
+        char key[64];
+        snprintf(key, sizeof(key), "touch.%s.mb", touch_names[g_touch_mode]);
+        out_value(key, (double)mb, "MB", BETTER_NONE);
+        snprintf(key, sizeof(key), "touch.%s.faults", touch_names[g_touch_mode]);
+        out_value(key, (double)(g_shared->minflt + g_shared->majflt), "faults", BETTER_LOWER);
+        snprintf(key, sizeof(key), "touch.%s.s_per_gib", touch_names[g_touch_mode]);
+        out_value(key, gib > 0 ? g_shared->time_ns / 1e9 / gib : 0.0, "s/GiB", BETTER_LOWER);
+        snprintf(key, sizeof(key), "touch.%s.rss_mb", touch_names[g_touch_mode]);
+        out_value(key, (double)(g_shared->rss_kb / KB), "MB", BETTER_NONE);
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* set by the parent before fork() */
+static int g_threads;
+static size_t g_max_size = 64;
+static int g_alloc_pct = 50;
+static long g_run_ms = 500;
+
+static int g_last_run; /* only the largest run dumps malloc_stats() */
+
+static pthread_barrier_t g_start;
+static pthread_mutex_t g_gate = PTHREAD_MUTEX_INITIALIZER; /* held until g_start is set up */
+static volatile int g_stop;
+
+static void *contender(void *arg)
+{
+    long id = (long)arg;
+    void *p[64] = {0};
+    uint32_t r = (uint32_t)id + 1;
+    long ops = 0;
+
+    pthread_mutex_lock(&g_gate); /* g_start only exists once the gate opens */
+    pthread_mutex_unlock(&g_gate);
+    pthread_barrier_wait(&g_start);
+    while (!g_stop) {
+        r = r * 1103515245 + 12345; /* same glibc LCG as the PD-Heap timing test */
+        int i = (r >> 16) & 63;
+        if ((int)((r >> 8) % 100) < g_alloc_pct) {
+            if (!p[i]) {
+                p[i] = malloc(1 + (r >> 4) % g_max_size);
+                if (p[i]) {
+                    *(char *)p[i] = 1;
+                    ops++; /* a NULL is not work done */
+                }
+            }
+        } else if (p[i]) {
+            free(p[i]);
+            p[i] = NULL;
+            ops++;
+        }
+        if ((ops & 1023) == 0) {
+            g_shared->ops[id] = ops; /* keep the shared count fresh without a store per op */
+        }
+    }
+    g_shared->ops[id] = ops;
+    for (int i = 0; i < 64; i++) free(p[i]);
+    return NULL;
+}
+
+/* glibc has no call for the arena count, but malloc_info() lists one <heap> per arena */
+static long count_arenas(void)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return -1;
+    malloc_info(0, f);
+    fclose(f);
+
+    long n = 0;
+    for (char *s = buf; (s = strstr(s, "<heap nr=")); s++) n++;
+    free(buf);
+    return n;
+}
+
+void child_threads(void)
+{
+    pthread_t tid[MAX_THREADS];
+    struct rusage ru;
+
+    /* the barrier can only be sized once we know how many threads really started */
+    pthread_mutex_lock(&g_gate);
+    int started = 0;
+    for (long t = 0; t < g_threads; t++) {
+        if (pthread_create(&tid[t], NULL, contender, (void *)t) != 0) {
+            fprintf(stderr, "pthread_create failed, running with %d of %d threads\n", started, g_threads);
+            break;
+        }
+        started++;
+    }
+    for (int t = started; t < g_threads; t++) {
+        g_shared->ops[t] = 0;
+    }
+    g_shared->started = started;
+    pthread_barrier_init(&g_start, NULL, (unsigned)started + 1);
+    pthread_mutex_unlock(&g_gate);
+
+    pthread_barrier_wait(&g_start);
+    int64_t t0 = now_ns();
+    struct timespec run = { g_run_ms / 1000, (g_run_ms % 1000) * 1000000L };
+    nanosleep(&run, NULL);
+    g_stop = 1;
+    for (int t = 0; t < started; t++) {
+        pthread_join(tid[t], NULL);
+    }
+    g_shared->time_ns = now_ns() - t0;
+
+    struct mallinfo2 mi = mallinfo2();
+    getrusage(RUSAGE_SELF, &ru);
+    g_shared->arenas = count_arenas();
+    g_shared->sys_bytes = (long)(mi.arena + mi.hblkhd);
+    g_shared->mmapped = (long)mi.hblks;
+    g_shared->nvcsw = ru.ru_nvcsw;
+    g_shared->stime_ns = (int64_t)ru.ru_stime.tv_sec * 1000000000LL + ru.ru_stime.tv_usec * 1000LL;
+    if (g_last_run) {
+        malloc_stats();
+    }
+}
+
+int run_threads(int max_threads)
+{
+    printf("malloc/free contention, sizes 1..%zu, %d%% alloc, %ld ms per run:\n\n", g_max_size, g_alloc_pct, g_run_ms);
+    printf("%7s %12s %12s %12s %8s %6s %10s %9s %9s\n",
+           "threads", "Mops/s", "min/thread", "max/thread", "fairness", "arenas", "heap MB", "vol. csw", "sys ms");
+
+    for (int n = 1; ; n = n * 2 > max_threads && n < max_threads ? max_threads : n * 2) {
+        g_threads = n;
+        g_last_run = (n == max_threads);
+        g_shared->started = 0;
+        run_in_child(child_threads);
+        int m = g_shared->started; /* fewer than n if pthread_create() failed */
+        if (m == 0) {
+            printf("%7d  no thread could be started\n", n);
+            break;
+        }
+
+        double sum = 0, sum_sq = 0;
+        long lo = g_shared->ops[0], hi = g_shared->ops[0];
+        for (int t = 0; t < m; t++) {
+            double x = (double)g_shared->ops[t];
+            sum += x;
+            sum_sq += x * x;
+            if (g_shared->ops[t] < lo) lo = g_shared->ops[t];
+            if (g_shared->ops[t] > hi) hi = g_shared->ops[t];
+        }
+        double secs = g_shared->time_ns / 1e9;
+        printf("%7d %12.3f %12ld %12ld %8.3f %6ld %10.1f %9ld %9.1f\n",
+               m, secs > 0 ? sum / secs / 1e6 : 0.0, lo, hi,
+               sum_sq > 0 ? sum * sum / (m * sum_sq) : 0.0, /* Jain's fairness index */
+               g_shared->arenas, g_shared->sys_bytes / (double)MB, g_shared->nvcsw, g_shared->stime_ns / 1e6);
+
+        char key[64];
+        snprintf(key, sizeof(key), "threads.%d.mops", n);
+        out_value(key, secs > 0 ? sum / secs / 1e6 : 0.0, "Mops/s", BETTER_HIGHER);
+        snprintf(key, sizeof(key), "threads.%d.fairness", n);
+        out_value(key, sum_sq > 0 ? sum * sum / (m * sum_sq) : 0.0, "jain", BETTER_HIGHER);
+        snprintf(key, sizeof(key), "threads.%d.arenas", n);
+        out_value(key, (double)g_shared->arenas, "arenas", BETTER_NONE);
+        snprintf(key, sizeof(key), "threads.%d.sys_ms", n);
+        out_value(key, g_shared->stime_ns / 1e6, "ms", BETTER_LOWER);
+
+        if (n >= max_threads) break;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* set by the parent before fork() */
+static int g_release_mode;
+static size_t g_release_size = 256 * MB;
+
+#define REL_FREE_LARGE 0
+#define REL_FREE_SMALL 1
+#define REL_TRIM       2
+#define REL_MUNMAP     3
+#define REL_DONTNEED   4
+#define REL_FREE       5
+
+static const char *release_names[] = { "free large", "free small", "malloc_trim", "munmap", "DONTNEED", "FREE" };
+static const char *release_keys[]  = { "free_large", "free_small", "malloc_trim", "munmap", "dontneed", "madv_free" };
+
+/* Resident set in KB, second field of /proc/self/statm (in pages). */
+static long statm_rss_kb(int fd)
+{
+    char buf[128];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    long size, resident;
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2) return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / KB);
+}
+
+static void touch_all(unsigned char *p, size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += (size_t)page) {
+        p[off] = 1;
+    }
+}
+
+void child_release(void)
+{
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) return;
+
+    size_t size = g_release_size;
+    size_t nsmall = size / SMALL_BLOCK;
+    unsigned char **small = NULL;
+    unsigned char *big = NULL;
+
+    /* acquire and touch, the way each strategy would have gotten the memory */
+    if (g_release_mode == REL_FREE_SMALL || g_release_mode == REL_TRIM) {
+        small = mmap(NULL, nsmall * sizeof(*small), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (small == MAP_FAILED) return;
+        for (size_t i = 0; i < nsmall; i++) {
+            small[i] = malloc(SMALL_BLOCK);
+            if (!small[i]) return;
+            touch_all(small[i], SMALL_BLOCK);
+        }
+    } else if (g_release_mode == REL_FREE_LARGE) {
+        big = malloc(size);
+        if (!big) return;
+        touch_all(big, size);
+    } else {
+        big = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (big == MAP_FAILED) return;
+        touch_all(big, size);
+    }
+    g_shared->rss_before_kb = statm_rss_kb(fd);
+
+    int64_t t0 = now_ns();
+    switch (g_release_mode) {
+    case REL_FREE_LARGE: free(big); g_shared->calls = 1; break;
+    case REL_FREE_SMALL:
+    case REL_TRIM:
+        for (size_t i = 0; i + 1 < nsmall; i++) {
+            free(small[i]);
+        }
+        g_shared->calls = (long)nsmall - 1;
+        if (g_release_mode == REL_TRIM) {
+            t0 = now_ns(); /* only malloc_trim itself is the release call here */
+            malloc_trim(0);
+            g_shared->calls = 1;
+        }
+        break;
+    case REL_MUNMAP:   munmap(big, size); g_shared->calls = 1; break;
+    case REL_DONTNEED: madvise(big, size, MADV_DONTNEED); g_shared->calls = 1; break;
+    case REL_FREE:     madvise(big, size, MADV_FREE); g_shared->calls = 1; break;
+    }
+    int64_t t1 = now_ns();
+    g_shared->call_ns = t1 - t0;
+
+    /* watch the resident set go down (or not) */
+    long target = g_shared->rss_before_kb - (long)(size / KB) * 9 / 10;
+    long rss = statm_rss_kb(fd);
+    int64_t t = t1;
+    struct timespec gap = { 0, RELEASE_SAMPLE_NS };
+    g_shared->drop_ns = -1;
+    while (1) {
+        if (rss <= target) {
+            g_shared->drop_ns = t - t1;
+            break;
+        }
+        if (t - t1 >= RELEASE_WINDOW_NS) break;
+        nanosleep(&gap, NULL);
+        rss = statm_rss_kb(fd);
+        t = now_ns();
+    }
+    g_shared->rss_after_kb = rss;
+    close(fd);
+}
+
+int run_release(void)
+{
+    printf("Releasing %zu MB (RSS watched for %lld ms):\n\n", g_release_size / MB, RELEASE_WINDOW_NS / 1000000);
+
+    for (g_release_mode = REL_FREE_LARGE; g_release_mode <= REL_FREE; g_release_mode++) {
+        printf("%-11s : ", release_names[g_release_mode]); fflush(stdout);
+
+        run_in_child(child_release);
+        if (g_shared->calls == 0) {
+            printf("could not allocate\n");
+            continue;
+        }
+        printf("%8ld calls, %10.3f us/call, %10.3f ms total, RSS %ld -> %ld MB, ",
+               g_shared->calls, g_shared->call_ns / 1e3 / g_shared->calls, g_shared->call_ns / 1e6,
+               g_shared->rss_before_kb / KB, g_shared->rss_after_kb / KB);
+        if (g_shared->drop_ns >= 0) printf("dropped after %.3f ms\n", g_shared->drop_ns / 1e6);
+        else printf("not returned\n");
+
+        char key[64];
+        snprintf(key, sizeof(key), "release.%s.us_per_call", release_keys[g_release_mode]);
+        out_value(key, g_shared->call_ns / 1e3 / g_shared->calls, "us", BETTER_LOWER);
+        snprintf(key, sizeof(key), "release.%s.rss_after_mb", release_keys[g_release_mode]);
+        out_value(key, (double)(g_shared->rss_after_kb / KB), "MB", BETTER_LOWER);
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+static int run_default(void)
+{
+    printf("Maximum reservable memory (1 MB at a time, separate address spaces for each function):\n\n");
 
     printf("malloc : "); fflush(stdout); /* fflush to prevent the child from double printing the text after inheriting the stdio buffer */
-    printf("%ld MB\n", run_in_child(child_malloc));
+    long mb = run_in_child(child_malloc);
+    printf("%ld MB\n", mb);
+    out_value("default.malloc.mb", (double)mb, "MB", BETTER_HIGHER);
 
     printf("mmap   : "); fflush(stdout);
-    printf("%ld MB\n", run_in_child(child_mmap));
+    mb = run_in_child(child_mmap);
+    printf("%ld MB\n", mb);
+    out_value("default.mmap.mb", (double)mb, "MB", BETTER_HIGHER);
 
     printf("sbrk   : "); fflush(stdout);
-    printf("%ld MB\n", run_in_child(child_sbrk));
+    mb = run_in_child(child_sbrk);
+    printf("%ld MB\n", mb);
+    out_value("default.sbrk.mb", (double)mb, "MB", BETTER_HIGHER);
 
     return 0;
 }
+
+static int dispatch(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "probe") == 0) {
+        long kb = argc > 2 ? atol(argv[2]) : MB / KB;
+        if (kb <= 0) {
+            fprintf(stderr, "usage: %s probe [precision_KB]\n", argv[0]);
+            return 1;
+        }
+        return run_probe((size_t)kb * KB);
+    }
+    if (argc > 1 && strcmp(argv[1], "touch") == 0) {
+        long limit = argc > 2 ? atol(argv[2]) : 0;
+        if (limit < 0) {
+            fprintf(stderr, "usage: %s touch [limit_MB]\n", argv[0]);
+            return 1;
+        }
+        return run_touch(limit);
+    }
+    if (argc > 1 && strcmp(argv[1], "threads") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : 64;
+        if (argc > 3) g_max_size = (size_t)atol(argv[3]);
+        if (argc > 4) g_alloc_pct = atoi(argv[4]);
+        if (argc > 5) g_run_ms = atol(argv[5]);
+        if (max_threads < 1 || max_threads > MAX_THREADS || g_max_size == 0
+            || g_alloc_pct < 1 || g_alloc_pct > 99 || g_run_ms <= 0) {
+            fprintf(stderr, "usage: %s threads [max_threads<=%d] [max_size] [alloc_pct 1-99] [ms]\n", argv[0], MAX_THREADS);
+            return 1;
+        }
+        return run_threads(max_threads);
+    }
+    if (argc > 1 && strcmp(argv[1], "release") == 0) {
+        long mb = argc > 2 ? atol(argv[2]) : (long)(g_release_size / MB);
+        if (mb <= 0) {
+            fprintf(stderr, "usage: %s release [size_MB]\n", argv[0]);
+            return 1;
+        }
+        g_release_size = (size_t)mb * MB;
+        return run_release();
+    }
+
+    return run_default();
+}
+
+int main(int argc, char **argv)
+{
+    if (out_init(&argc, argv, "md_mem") < 0) {
+        fprintf(stderr, "usage: %s [-f text|csv|json] [probe|touch|threads|release ...]\n", argv[0]);
+        return 1;
+    }
+    init_shared();
+
+    int rc = dispatch(argc, argv);
+    out_end();
+    return rc;
+}
@@ -1,5 +1,7 @@
 /*
 md_mem copy with reservation size limits and time logging using time.h
+
+"-f csv" / "-f json" print the three timings as records (see md_out.h).
 */
 
 #include <stdio.h>
@@ -8,6 +10,7 @@ md_mem copy with reservation size limits and time logging using time.h
 #include <sys/mman.h>    /* mmap */
 #include <sys/wait.h>    /* waitpid */
 #include <unistd.h>      /* fork, sbrk */
+#include "md_out.h"      /* out_value */
 
 #define MB (1024 * 1024)
 #define LIMIT_MB (100)
@@ -56,7 +59,7 @@ Forks fn() into a child, waits for it, returns the count.
 void run_in_child(void (*fn)(void))  /* (*fn) makes fn a function pointer, not a void pointer; the voids specify no return value and no arguments */
 {
     *g_time_ns = 0;
-    fflush(stdout);
+    fflush(NULL); /* every stream, the -f record stream would otherwise be written twice too */
 
     pid_t pid = fork();              /* duplicate this process */
     if (pid < 0) { perror("fork"); exit(1); }
@@ -91,8 +94,12 @@ void child_sbrk(void)
 }
 
 /* ------------------------------------------------------------------ */
-int main(void)
+int main(int argc, char **argv)
 {
+    if (out_init(&argc, argv, "md_mem_100_cleaner") < 0 || argc > 1) {
+        fprintf(stderr, "usage: %s [-f text|csv|json]\n", argv[0]);
+        return 1;
+    }
     printf("Time to reserve 100 MB (1 MB at a time):\n\n");
 
     init_shared();
@@ -100,14 +107,18 @@ int main(void)
     printf("malloc : "); fflush(stdout); /* fflush to prevent the child from double printing the text after inheriting the stdio buffer */
     run_in_child(child_malloc);
     printf("%.6f s\n", *g_time_ns / 1e9); /* float with 6 digit precision */
+    out_value("reserve100.malloc.s", *g_time_ns / 1e9, "s", BETTER_LOWER);
 
     printf("mmap   : "); fflush(stdout);
     run_in_child(child_mmap);
     printf("%.6f s\n", *g_time_ns / 1e9);
+    out_value("reserve100.mmap.s", *g_time_ns / 1e9, "s", BETTER_LOWER);
 
     printf("sbrk   : "); fflush(stdout);
     run_in_child(child_sbrk);
     printf("%.6f s\n", *g_time_ns / 1e9);
-    
+    out_value("reserve100.sbrk.s", *g_time_ns / 1e9, "s", BETTER_LOWER);
+
+    out_end();
     return 0;
 }
@@ -0,0 +1,88 @@
+/*
+md_out.h - machine readable results for the md_mem tools.
+
+    ./md_mem -f csv probe     one "tool,probe,value,unit,better" line per number
+    ./md_mem -f json probe    the same records as one JSON array
+
+In either mode the usual human readable lines are still printed, but to
+stderr: out_init() keeps a private copy of stdout for the records and then
+points stdout at stderr, so the existing printf() calls stay as they are.
+
+'better' says which direction is an improvement (lower / higher / none);
+md_bench uses it to tell a regression from a speedup.
+*/
+
+#ifndef MD_OUT_H
+#define MD_OUT_H
+
+#include <stdio.h>
+#include <string.h>  /* strcmp */
+#include <unistd.h>  /* dup, dup2 */
+
+#define OUT_TEXT 0
+#define OUT_CSV  1
+#define OUT_JSON 2
+
+#define BETTER_LOWER  "lower"
+#define BETTER_HIGHER "higher"
+#define BETTER_NONE   "none"
+
+static int g_out = OUT_TEXT;
+static FILE *g_out_file;
+static const char *g_out_tool;
+static int g_out_count;
+
+/*
+Removes "-f csv|json" from argv (anywhere, so positional mode arguments keep
+their places). Returns -1 on an unknown format.
+*/
+static int out_init(int *argc, char **argv, const char *tool)
+{
+    g_out_tool = tool;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "-f") != 0) {
+            continue;
+        }
+        if (i + 1 >= *argc) return -1;
+        if (strcmp(argv[i + 1], "csv") == 0) g_out = OUT_CSV;
+        else if (strcmp(argv[i + 1], "json") == 0) g_out = OUT_JSON;
+        else if (strcmp(argv[i + 1], "text") == 0) g_out = OUT_TEXT;
+        else return -1;
+
+        for (int j = i; j + 2 <= *argc; j++) {
+            argv[j] = argv[j + 2]; /* also moves the terminating NULL */
+        }
+        *argc -= 2;
+        break;
+    }
+
+    if (g_out != OUT_TEXT) {
+        fflush(stdout);
+        g_out_file = fdopen(dup(STDOUT_FILENO), "w");
+        if (!g_out_file) return -1;
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        if (g_out == OUT_CSV) fprintf(g_out_file, "tool,probe,value,unit,better\n");
+        else fprintf(g_out_file, "[");
+    }
+    return 0;
+}
+
+/* probe names are dotted paths like "touch.plain.s_per_gib" and never need escaping */
+static void out_value(const char *probe, double value, const char *unit, const char *better)
+{
+    if (g_out == OUT_CSV) {
+        fprintf(g_out_file, "%s,%s,%.9g,%s,%s\n", g_out_tool, probe, value, unit, better);
+    } else if (g_out == OUT_JSON) {
+        fprintf(g_out_file, "%s\n  {\"tool\": \"%s\", \"probe\": \"%s\", \"value\": %.9g, \"unit\": \"%s\", \"better\": \"%s\"}",
+                g_out_count ? "," : "", g_out_tool, probe, value, unit, better);
+    }
+    g_out_count++;
+}
+
+static void out_end(void)
+{
+    if (g_out == OUT_JSON) fprintf(g_out_file, "\n]\n");
+    if (g_out_file) fflush(g_out_file);
+}
+
+#endif
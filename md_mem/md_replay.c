@@ -0,0 +1,626 @@
+/*
+md_replay - replays an md_trace recording against different allocators.
+
+    ./md_replay run.trc [glibc] [arena] [./liballoc.so ...]
+
+With no allocator arguments glibc and arena are run. Anything containing
+a '/' is dlopen()ed and its malloc/calloc/realloc/free are used, so any
+locally built allocator can be compared on the same workload.
+
+    glibc - the C library's malloc
+    arena - bump allocation in 64 MB mmap() arenas, an arena is unmapped
+            once every block in it was freed (region allocator: no search
+            at all, but one long-lived block pins the whole arena)
+
+Every allocator runs in its own child process, for the same reasons as in
+md_mem: a fresh address space, and the results come back through a
+MAP_SHARED page. Each run reports:
+
+    replay time and ns per call (every new page is written once, so the
+        time includes first-touch faults the way the real program paid them)
+    peak RSS above the child's starting point, sampled from /proc/self/statm
+    peak live bytes - the most the program had asked for at one moment
+    fragmentation = 1 - peak live / peak RSS, the share of resident memory
+        that was headers, holes, or pages the allocator had not given back
+
+PREPARING THE TRACE:
+
+	Recorded pointers only mean something inside the traced process, so
+	before replaying every block gets a slot number: a hash map from
+	pointer to slot while scanning, and a stack of released slot numbers.
+	A slot goes back on the stack only once its block is freed, so no two
+	live blocks ever share a slot, and the replay table never needs more
+	slots than the most blocks live at once.
+	Frees of pointers that were never seen allocated (made before the shim
+	was loaded, or by memalign & co, which are not recorded) are dropped.
+
+	The replay is single-threaded, in the causal order of the records' seq
+	(see md_trace.h), so the sequence is valid, but lock contention is not
+	reproduced (md_mem threads measures that).
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>       /* dlopen, dlsym, dladdr1, dlinfo */
+#include <link.h>        /* struct link_map */
+#include <fcntl.h>       /* open */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>      /* memcpy, strchr */
+#include <sys/mman.h>    /* mmap */
+#include <sys/stat.h>    /* fstat */
+#include <sys/wait.h>    /* waitpid */
+#include <time.h>        /* clock_gettime */
+#include <unistd.h>      /* fork */
+
+#include "md_trace.h"
+
+#define KB 1024
+#define MB (1024 * 1024)
+#define ARENA_SIZE (64 * MB)
+#define RSS_SAMPLE_EVERY 4096 /* calls between statm samples */
+
+int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/*
+-------------------------------------------------------------------------------
+pointer -> slot map, open addressing with linear probing, key 0 = empty
+-------------------------------------------------------------------------------
+*/
+
+typedef struct PtrMap {
+    uint64_t *key;
+    uint32_t *val;
+    size_t cap, len; /* cap is a power of 2 */
+} PtrMap;
+
+/* Fibonacci hashing: heap pointers share their low bits, the multiply spreads them. */
+static size_t pm_hash(const PtrMap *m, uint64_t k)
+{
+    return (size_t)((k * 11400714819323198485ULL) >> 20) & (m->cap - 1);
+}
+
+static void pm_init(PtrMap *m, size_t cap)
+{
+    m->cap = cap;
+    m->len = 0;
+    m->key = calloc(cap, sizeof(uint64_t));
+    m->val = calloc(cap, sizeof(uint32_t));
+    if (!m->key || !m->val) { perror("calloc"); exit(1); }
+}
+
+static void pm_put(PtrMap *m, uint64_t k, uint32_t v);
+
+static void pm_grow(PtrMap *m)
+{
+    PtrMap n;
+    pm_init(&n, m->cap * 2);
+    for (size_t i = 0; i < m->cap; i++) {
+        if (m->key[i]) pm_put(&n, m->key[i], m->val[i]);
+    }
+    free(m->key);
+    free(m->val);
+    *m = n;
+}
+
+static void pm_put(PtrMap *m, uint64_t k, uint32_t v)
+{
+    if (m->len >= m->cap * 3 / 4) pm_grow(m);
+    size_t i = pm_hash(m, k);
+    while (m->key[i] && m->key[i] != k) i = (i + 1) & (m->cap - 1);
+    if (!m->key[i]) m->len++;
+    m->key[i] = k;
+    m->val[i] = v;
+}
+
+/* Remove k and return its value through *v. Backward-shift deletion, no tombstones. */
+static int pm_take(PtrMap *m, uint64_t k, uint32_t *v)
+{
+    size_t mask = m->cap - 1;
+    size_t i = pm_hash(m, k);
+    while (m->key[i] && m->key[i] != k) i = (i + 1) & mask;
+    if (!m->key[i]) return 0;
+
+    *v = m->val[i];
+    m->key[i] = 0;
+    m->len--;
+    for (size_t j = (i + 1) & mask; m->key[j]; j = (j + 1) & mask) {
+        size_t h = pm_hash(m, m->key[j]);
+        int stay = (i <= j) ? (h > i && h <= j) : (h > i || h <= j);
+        if (!stay) {
+            m->key[i] = m->key[j];
+            m->val[i] = m->val[j];
+            m->key[j] = 0;
+            i = j;
+        }
+    }
+    return 1;
+}
+
+/*
+-------------------------------------------------------------------------------
+trace -> slot based program
+-------------------------------------------------------------------------------
+*/
+
+typedef struct Op {
+    uint64_t size;
+    uint32_t slot;
+    uint8_t op;  /* TR_*; TR_REALLOC keeps its slot */
+} Op;
+
+static Op *ops;
+static size_t nops;
+static uint32_t nslots; /* peak number of live blocks */
+
+static uint32_t *free_slots; /* stack of slot numbers to reuse */
+static size_t nfree, free_cap;
+
+static uint32_t slot_new(void)
+{
+    if (nfree) return free_slots[--nfree];
+    return nslots++;
+}
+
+static void slot_release(uint32_t s)
+{
+    if (nfree == free_cap) {
+        free_cap = free_cap ? free_cap * 2 : 1024;
+        free_slots = realloc(free_slots, free_cap * sizeof(uint32_t));
+        if (!free_slots) { perror("realloc"); exit(1); }
+    }
+    free_slots[nfree++] = s;
+}
+
+static void emit(uint8_t op, uint32_t slot, uint64_t size)
+{
+    Op *o = &ops[nops++];
+    o->op = op;
+    o->slot = slot;
+    o->size = size;
+}
+
+/*
+A new block at ptr. Sorted by seq, md_trace.so's records are in causal
+order, so ptr is never live here. A trace that is missing records could still have it live, for
+example from a process killed mid-flush. In that case the free is invented
+so that the slot is not leaked.
+*/
+static void emit_new(uint8_t op, uint64_t ptr, uint64_t size, PtrMap *live)
+{
+    uint32_t s;
+    if (pm_take(live, ptr, &s)) {
+        emit(TR_FREE, s, 0);
+        slot_release(s);
+    }
+    s = slot_new();
+    pm_put(live, ptr, s);
+    emit(op, s, size);
+}
+
+static int by_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const TraceRec *)a)->seq, y = ((const TraceRec *)b)->seq;
+    return (x > y) - (x < y);
+}
+
+/*
+Turns the records, in the order they were written, into ops and slots. The
+number of calls (a realloc has two records) goes to *calls and the time the
+trace covers to *span_ns.
+*/
+static void prepare(const TraceRec *recorded, size_t n, long *threads, size_t *calls, uint64_t *span_ns)
+{
+    PtrMap live, tids, pending;
+    pm_init(&live, 1 << 16);
+    pm_init(&tids, 64);
+    pm_init(&pending, 64); /* tid + 1 -> slot of the block its realloc is releasing */
+
+    TraceRec *rec = malloc(n * sizeof(TraceRec) + 1);
+    if (!rec) { perror("malloc"); exit(1); }
+    memcpy(rec, recorded, n * sizeof(TraceRec));
+    qsort(rec, n, sizeof(TraceRec), by_seq);
+
+    /* a realloc can turn into free + malloc, so at most 2 ops per record */
+    ops = malloc(2 * n * sizeof(Op) + 1);
+    if (!ops) { perror("malloc"); exit(1); }
+
+    *calls = 0;
+    *span_ns = 0;
+    for (size_t i = 0; i < n; i++) {
+        const TraceRec *r = &rec[i];
+        uint32_t s;
+        pm_put(&tids, (uint64_t)r->tid + 1, 0);
+        if (r->ts_ns > *span_ns) *span_ns = r->ts_ns;
+        *calls += r->op != TR_REALLOC_BEGIN;
+
+        /* a realloc that released a block gets it back from pending, its address may already be reused */
+        if (r->op == TR_REALLOC && r->old && pm_take(&pending, (uint64_t)r->tid + 1, &s)) {
+            if (r->ptr) {
+                pm_put(&live, r->ptr, s);
+                emit(TR_REALLOC, s, r->size);
+            } else if (r->size == 0) { /* realloc(p, 0) freed p */
+                emit(TR_FREE, s, 0);
+                slot_release(s);
+            } else { /* it failed and p is untouched */
+                pm_put(&live, r->old, s);
+            }
+            continue;
+        }
+
+        switch (r->op) {
+        case TR_REALLOC_BEGIN:
+            if (pm_take(&live, r->ptr, &s)) pm_put(&pending, (uint64_t)r->tid + 1, s);
+            break;
+        case TR_MALLOC:
+        case TR_CALLOC:
+            if (r->ptr) emit_new(r->op, r->ptr, r->size, &live);
+            break;
+        case TR_FREE:
+            if (pm_take(&live, r->ptr, &s)) {
+                emit(TR_FREE, s, 0);
+                slot_release(s);
+            }
+            break;
+        case TR_REALLOC:
+            if (!r->old) { /* realloc(NULL, n) is malloc */
+                if (r->ptr) emit_new(TR_MALLOC, r->ptr, r->size, &live);
+            } else if (!r->ptr) {
+                if (r->size == 0 && pm_take(&live, r->old, &s)) { /* realloc(p, 0) freed p */
+                    emit(TR_FREE, s, 0);
+                    slot_release(s);
+                } /* otherwise it failed and p is untouched */
+            } else if (pm_take(&live, r->old, &s)) {
+                pm_put(&live, r->ptr, s);
+                emit(TR_REALLOC, s, r->size);
+            } else { /* resized a block we never saw: treat as new */
+                emit_new(TR_MALLOC, r->ptr, r->size, &live);
+            }
+            break;
+        }
+    }
+    *threads = (long)tids.len;
+    free(rec);
+    free(live.key); free(live.val);
+    free(tids.key); free(tids.val);
+    free(pending.key); free(pending.val);
+}
+
+/*
+-------------------------------------------------------------------------------
+allocators
+-------------------------------------------------------------------------------
+*/
+
+typedef struct Allocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*zalloc)(size_t n, size_t size);
+    void *(*resize)(void *ptr, size_t size);
+    void (*release)(void *ptr);
+} Allocator;
+
+/* arena: header at the start of each mapping, then blocks back to back */
+typedef struct Arena {
+    size_t cap;  /* bytes mapped */
+    size_t used; /* bump offset */
+    long live;   /* blocks not freed yet */
+} Arena;
+
+typedef struct Block {
+    Arena *arena;
+    size_t size;
+} Block;
+
+#define ARENA_HDR ((sizeof(Arena) + 15) & ~(size_t)15)
+#define ROUND16(n) (((n) + 15) & ~(size_t)15)
+
+static Arena *cur;
+
+static Arena *arena_new(size_t need)
+{
+    size_t cap = ARENA_HDR + need > ARENA_SIZE ? ROUND16(ARENA_HDR + need) : ARENA_SIZE;
+    void *p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    Arena *a = (Arena *)p;
+    a->cap = cap;
+    a->used = ARENA_HDR;
+    a->live = 0;
+    return a;
+}
+
+static void *arena_alloc(size_t size)
+{
+    size_t need = sizeof(Block) + ROUND16(size);
+    if (!cur || cur->used + need > cur->cap) {
+        Arena *old = cur;
+        Arena *a = arena_new(need);
+        if (!a) return NULL;
+        cur = a;
+        if (old && old->live == 0) munmap(old, old->cap); /* nothing was keeping it */
+    }
+    Block *b = (Block *)((char *)cur + cur->used);
+    cur->used += need;
+    cur->live++;
+    b->arena = cur;
+    b->size = size;
+    return b + 1;
+}
+
+static void arena_free(void *ptr)
+{
+    if (!ptr) return;
+    Arena *a = ((Block *)ptr - 1)->arena;
+    if (--a->live == 0 && a != cur) {
+        munmap(a, a->cap);
+    }
+}
+
+/* bump memory is never reused, so it is still the kernel's zero pages */
+static void *arena_calloc(size_t n, size_t size)
+{
+    if (size && n > SIZE_MAX / size) return NULL;
+    return arena_alloc(n * size);
+}
+
+static void *arena_realloc(void *ptr, size_t size)
+{
+    if (!ptr) return arena_alloc(size);
+    if (!size) { arena_free(ptr); return NULL; }
+
+    Block *b = (Block *)ptr - 1;
+    if (size <= b->size) return ptr; /* shrinking never gives bytes back, calloc relies on that */
+    char *end = (char *)ptr + ROUND16(b->size);
+    /* the newest block in the current arena can simply grow */
+    if (b->arena == cur && end == (char *)cur + cur->used
+        && (char *)ptr + ROUND16(size) <= (char *)cur + cur->cap) {
+        cur->used = (size_t)((char *)ptr + ROUND16(size) - (char *)cur);
+        b->size = size;
+        return ptr;
+    }
+    void *p = arena_alloc(size);
+    if (!p) return NULL;
+    memcpy(p, ptr, b->size < size ? b->size : size);
+    arena_free(ptr);
+    return p;
+}
+
+static void *glibc_calloc(size_t n, size_t size) { return calloc(n, size); }
+static void *glibc_malloc(size_t size) { return malloc(size); }
+static void *glibc_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+static void glibc_free(void *ptr) { free(ptr); }
+
+/*
+Address of symbol name defined in the library h itself, NULL if it has none. dlsym()
+also searches the library's dependencies, so a library without its own free
+would silently get libc's, and the replay would measure glibc.
+*/
+static void *own_symbol(void *h, const char *name)
+{
+    struct link_map *lib, *owner;
+    Dl_info info;
+    void *p = dlsym(h, name);
+    if (!p || dlinfo(h, RTLD_DI_LINKMAP, &lib) != 0
+        || !dladdr1(p, &info, (void **)&owner, RTLD_DL_LINKMAP) || owner != lib) {
+        return NULL;
+    }
+    return p;
+}
+
+/* Fills a from the dlopen()ed library; returns 0 on failure. Runs in the child. */
+static int load_so(Allocator *a)
+{
+    void *h = dlopen(a->name, RTLD_NOW | RTLD_LOCAL);
+    if (!h) {
+        fprintf(stderr, "%s\n", dlerror());
+        return 0;
+    }
+    a->alloc = (void *(*)(size_t))own_symbol(h, "malloc");
+    a->zalloc = (void *(*)(size_t, size_t))own_symbol(h, "calloc");
+    a->resize = (void *(*)(void *, size_t))own_symbol(h, "realloc");
+    a->release = (void (*)(void *))own_symbol(h, "free");
+    if (!a->alloc || !a->zalloc || !a->resize || !a->release) {
+        fprintf(stderr, "%s: needs its own malloc, calloc, realloc and free\n", a->name);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+-------------------------------------------------------------------------------
+replay in a child
+-------------------------------------------------------------------------------
+*/
+
+typedef struct Result {
+    int64_t time_ns;
+    long calls;
+    long failures;
+    long peak_rss_kb; /* above the child's starting RSS */
+    uint64_t peak_live;
+    int done;
+} Result;
+
+static Result *g_res; /* shared page, see md_mem.c */
+static Allocator g_alloc;
+
+static long statm_rss_kb(int fd)
+{
+    char buf[128];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+
+    long size, resident;
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2) return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / KB);
+}
+
+static void touch(void *p, size_t size)
+{
+    for (size_t off = 0; off < size; off += 4096) {
+        ((volatile char *)p)[off] = 1;
+    }
+}
+
+static void child_replay(void)
+{
+    if (strchr(g_alloc.name, '/') && !load_so(&g_alloc)) {
+        return;
+    }
+
+    /* slot tables come straight from mmap so they do not sit in the allocator being measured */
+    void **slot = mmap(NULL, (size_t)nslots * sizeof(void *) + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint64_t *slot_size = mmap(NULL, (size_t)nslots * sizeof(uint64_t) + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slot == MAP_FAILED || slot_size == MAP_FAILED) return;
+
+    int fd = open("/proc/self/statm", O_RDONLY);
+    long base = statm_rss_kb(fd);
+    long peak = base;
+    uint64_t live = 0, sampled_live = 0;
+    long failures = 0;
+
+    int64_t t0 = now_ns();
+    for (size_t i = 0; i < nops; i++) {
+        const Op *o = &ops[i];
+        void *p;
+        switch (o->op) {
+        case TR_MALLOC:
+        case TR_CALLOC:
+            p = o->op == TR_MALLOC ? g_alloc.alloc(o->size) : g_alloc.zalloc(1, o->size);
+            if (!p && o->size) { failures++; break; }
+            touch(p, o->size);
+            slot[o->slot] = p;
+            slot_size[o->slot] = o->size;
+            live += o->size;
+            break;
+        case TR_REALLOC:
+            if (!slot[o->slot]) break; /* its original allocation failed */
+            p = g_alloc.resize(slot[o->slot], o->size);
+            if (!p) { failures++; break; }
+            touch(p, o->size);
+            live += o->size - slot_size[o->slot];
+            slot[o->slot] = p;
+            slot_size[o->slot] = o->size;
+            break;
+        case TR_FREE:
+            if (!slot[o->slot]) break;
+            g_alloc.release(slot[o->slot]);
+            live -= slot_size[o->slot];
+            slot[o->slot] = NULL;
+            break;
+        }
+        /* sample on a schedule, and whenever live data climbs another MB past its peak */
+        int sample = (i & (RSS_SAMPLE_EVERY - 1)) == 0;
+        if (live > g_res->peak_live) {
+            if (live >= sampled_live + MB) {
+                sample = 1;
+                sampled_live = live;
+            }
+            g_res->peak_live = live;
+        }
+        if (sample) {
+            long rss = statm_rss_kb(fd);
+            if (rss > peak) peak = rss;
+        }
+    }
+    g_res->time_ns = now_ns() - t0;
+
+    long rss = statm_rss_kb(fd);
+    if (rss > peak) peak = rss;
+    g_res->peak_rss_kb = peak - base;
+    g_res->calls = (long)nops;
+    g_res->failures = failures;
+    g_res->done = 1;
+    close(fd);
+}
+
+static void run_in_child(void (*fn)(void))
+{
+    memset(g_res, 0, sizeof(Result));
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        fn();
+        exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+/* ------------------------------------------------------------------ */
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.trc [glibc] [arena] [./liballoc.so ...]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "cannot read trace '%s'\n", argv[1]);
+        return 1;
+    }
+    const unsigned char *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) { perror("mmap"); return 1; }
+    const TraceHeader *h = (const TraceHeader *)map;
+    if (memcmp(h->magic, TRACE_MAGIC, 4) != 0 || h->version != TRACE_VERSION || h->rec_size != sizeof(TraceRec)) {
+        fprintf(stderr, "'%s' is not an md_trace v%d file\n", argv[1], TRACE_VERSION);
+        return 1;
+    }
+    const TraceRec *rec = (const TraceRec *)(map + sizeof(TraceHeader));
+    size_t nrec = ((size_t)st.st_size - sizeof(TraceHeader)) / sizeof(TraceRec);
+
+    long threads;
+    size_t calls;
+    uint64_t span_ns;
+    prepare(rec, nrec, &threads, &calls, &span_ns);
+    printf("%s: %zu calls from %ld thread(s) over %.3f s, %u blocks live at most\n\n",
+           argv[1], calls, threads, span_ns / 1e9, nslots);
+    munmap((void *)map, (size_t)st.st_size);
+    close(fd);
+
+    void *p = mmap(NULL, sizeof(Result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) { perror("mmap"); return 1; }
+    g_res = (Result *)p;
+
+    const char *defaults[] = { "glibc", "arena" };
+    const char **names = argc > 2 ? (const char **)argv + 2 : defaults;
+    int count = argc > 2 ? argc - 2 : 2;
+
+    printf("%-24s %10s %9s %9s %12s %13s %14s\n",
+           "allocator", "time ms", "ns/call", "failures", "peak RSS MB", "peak live MB", "fragmentation");
+    for (int i = 0; i < count; i++) {
+        g_alloc.name = names[i];
+        if (strcmp(names[i], "glibc") == 0) {
+            g_alloc.alloc = glibc_malloc; g_alloc.zalloc = glibc_calloc;
+            g_alloc.resize = glibc_realloc; g_alloc.release = glibc_free;
+        } else if (strcmp(names[i], "arena") == 0) {
+            g_alloc.alloc = arena_alloc; g_alloc.zalloc = arena_calloc;
+            g_alloc.resize = arena_realloc; g_alloc.release = arena_free;
+        } else if (!strchr(names[i], '/')) {
+            fprintf(stderr, "unknown allocator '%s' (use glibc, arena or a path to a .so)\n", names[i]);
+            continue;
+        }
+
+        run_in_child(child_replay);
+        if (!g_res->done) {
+            printf("%-24s did not finish\n", names[i]);
+            continue;
+        }
+        double rss_mb = g_res->peak_rss_kb / (double)KB;
+        double live_mb = g_res->peak_live / (double)MB;
+        printf("%-24s %10.3f %9.1f %9ld %12.1f %13.1f %13.1f%%\n",
+               names[i], g_res->time_ns / 1e6, g_res->calls ? (double)g_res->time_ns / g_res->calls : 0.0,
+               g_res->failures, rss_mb, live_mb, rss_mb > 0 && rss_mb > live_mb ? 100.0 * (1 - live_mb / rss_mb) : 0.0);
+    }
+    return 0;
+}
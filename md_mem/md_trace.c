@@ -0,0 +1,249 @@
+/*
+md_trace - LD_PRELOAD shim that records every malloc/calloc/realloc/free
+into a compact binary trace (format in md_trace.h) for md_replay.
+
+    LD_PRELOAD=./md_trace.so MD_TRACE=run.trc ./program
+    ./md_replay run.trc
+
+MD_TRACE defaults to md_trace.%p.trc; a %p in the name is replaced with the
+pid, so a script that execs other programs gives one trace per process.
+Forked children stop recording (they would share the parent's file).
+
+The real work is passed on to glibc's __libc_* entry points instead of
+dlsym(RTLD_NEXT, ...), because dlsym() itself calls calloc() and the first
+malloc of the process would recurse into us before we have a pointer.
+Nothing in here allocates: records go into a static buffer, the buffer
+goes to the file with write(), and TLS is initial-exec (see Makefile) so
+even the first access from a new thread cannot call malloc.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>       /* open */
+#include <pthread.h>     /* pthread_atfork */
+#include <stdatomic.h>   /* atomic_flag, atomic_fetch_add */
+#include <stdlib.h>      /* getenv */
+#include <sys/syscall.h> /* SYS_gettid */
+#include <time.h>        /* clock_gettime */
+#include <unistd.h>      /* write, getpid */
+
+#include "md_trace.h"
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+#define TRACE_BUF 8192 /* records per write(), 384 KB */
+
+static TraceRec buf[TRACE_BUF];
+static int used;
+static atomic_flag lock = ATOMIC_FLAG_INIT;
+static _Atomic uint64_t next_seq; /* TraceRec.seq */
+
+static int fd = -1;
+static int disabled; /* set in forked children and after an open() failure */
+static int64_t t_start;
+
+static __thread uint32_t my_tid;
+
+static int64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* MD_TRACE with %p replaced by the pid, no snprintf (it may allocate). */
+static void trace_path(char *out, size_t cap)
+{
+    const char *name = getenv("MD_TRACE");
+    if (!name || !*name) {
+        name = "md_trace.%p.trc";
+    }
+
+    char pid[16];
+    int plen = 0;
+    for (long p = getpid(); p; p /= 10) {
+        pid[plen++] = (char)('0' + p % 10);
+    }
+
+    size_t n = 0;
+    for (const char *s = name; *s && n + 1 < cap; s++) {
+        if (s[0] == '%' && s[1] == 'p') {
+            for (int i = plen - 1; i >= 0 && n + 1 < cap; i--) out[n++] = pid[i];
+            s++;
+        } else {
+            out[n++] = *s;
+        }
+    }
+    out[n] = '\0';
+}
+
+/* Called with the lock held. Opens the file on first use, then drains buf. */
+static void flush_locked(void)
+{
+    if (fd < 0 && !disabled) {
+        char path[4096];
+        trace_path(path, sizeof(path));
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            disabled = 1;
+        } else {
+            TraceHeader h = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRec), 0 };
+            if (write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)) {
+                disabled = 1;
+            }
+        }
+    }
+    if (fd >= 0 && used > 0) {
+        const char *p = (const char *)buf;
+        size_t left = (size_t)used * sizeof(TraceRec);
+        while (left > 0) {
+            ssize_t n = write(fd, p, left);
+            if (n <= 0) break;
+            p += n;
+            left -= (size_t)n;
+        }
+    }
+    used = 0;
+}
+
+static void lock_trace(void)
+{
+    if (!my_tid) {
+        my_tid = (uint32_t)syscall(SYS_gettid);
+    }
+    while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire)) {
+        /* spin - the critical section is a 48 byte copy or two */
+    }
+}
+
+static void unlock_trace(void)
+{
+    atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+/* The next position in causal order: take it before releasing a block, after getting one. */
+static uint64_t take_seq(void)
+{
+    return atomic_fetch_add(&next_seq, 1);
+}
+
+/* Append one record, timestamped t. Called with the lock held. */
+static void record_locked(uint64_t seq, int64_t t, uint8_t op, void *ptr, void *old, size_t size)
+{
+    if (!t_start) {
+        t_start = t;
+    }
+    TraceRec *r = &buf[used++];
+    r->seq = seq;
+    r->ts_ns = (uint64_t)(t - t_start);
+    r->ptr = (uint64_t)(uintptr_t)ptr;
+    r->old = (uint64_t)(uintptr_t)old;
+    r->size = size;
+    r->tid = my_tid;
+    r->op = op;
+    if (used == TRACE_BUF) {
+        flush_locked();
+    }
+}
+
+static void record(uint64_t seq, uint8_t op, void *ptr, void *old, size_t size)
+{
+    if (disabled) {
+        return;
+    }
+    int64_t t = now_ns();
+    lock_trace();
+    record_locked(seq, t, op, ptr, old, size);
+    unlock_trace();
+}
+
+/* The fork happens with our lock free (atfork prepare takes it), so the child can safely drop out. */
+static void atfork_prepare(void)
+{
+    while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire)) {
+    }
+}
+
+static void atfork_parent(void)
+{
+    atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+static void atfork_child(void)
+{
+    disabled = 1;
+    used = 0;
+    fd = -1; /* the inherited descriptor still belongs to the parent's trace */
+    atomic_flag_clear_explicit(&lock, memory_order_release);
+}
+
+__attribute__((constructor))
+static void trace_init(void)
+{
+    pthread_atfork(atfork_prepare, atfork_parent, atfork_child);
+}
+
+__attribute__((destructor))
+static void trace_fini(void)
+{
+    atfork_prepare();
+    flush_locked();
+    disabled = 1; /* whatever runs after us (other destructors) is not recorded */
+    atfork_parent();
+}
+
+/*
+-------------------------------------------------------------------------------
+exported replacements
+-------------------------------------------------------------------------------
+*/
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+    record(take_seq(), TR_MALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+    record(take_seq(), TR_CALLOC, p, NULL, n * size);
+    return p;
+}
+
+/*
+A moving realloc both gets a new block and releases the old one inside libc,
+so it takes two positions in the order (see md_trace.h): one before the call
+for old, one after for the result. Other threads' calls keep running
+meanwhile, nothing is locked across libc.
+*/
+void *realloc(void *ptr, size_t size)
+{
+    if (disabled || !ptr) {
+        void *p = __libc_realloc(ptr, size);
+        record(take_seq(), TR_REALLOC, p, ptr, size); /* nothing is released */
+        return p;
+    }
+    int64_t t = now_ns();
+    uint64_t begin = take_seq();
+    void *p = __libc_realloc(ptr, size);
+    uint64_t end = take_seq();
+    lock_trace();
+    record_locked(begin, t, TR_REALLOC_BEGIN, ptr, NULL, size);
+    record_locked(end, now_ns(), TR_REALLOC, p, ptr, size);
+    unlock_trace();
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    /* the seq is taken before the block can be handed to another thread */
+    record(take_seq(), TR_FREE, ptr, NULL, 0);
+    __libc_free(ptr);
+}
@@ -0,0 +1,57 @@
+/*
+md_trace.h - on-disk format shared by the md_trace.so recorder and md_replay.
+
+A trace is one TraceHeader followed by fixed-size TraceRec records. Threads
+append them in whatever order they finish, so a reader sorts by seq, one
+number from a global counter, which gives the causal order: a block is
+released before anything gets its address again. A release takes its seq
+before the libc call, and getting a block takes it after, so the release
+always has the smaller seq:
+
+    free(p)          TR_FREE, seq taken before __libc_free
+    malloc, calloc   TR_MALLOC / TR_CALLOC, seq taken after the call
+    realloc(old, n)  TR_REALLOC_BEGIN (ptr = old) with a seq taken before the
+                     call, for releasing old, then TR_REALLOC (ptr = result)
+                     with one taken after, for what it returned.
+                     realloc(NULL, n) writes only the TR_REALLOC.
+
+Between the two realloc records, another thread's malloc may already return
+old, and another thread's free may name the block realloc is about to return.
+A thread has at most one realloc in flight, so a reader pairs the two records
+by tid.
+*/
+
+#ifndef MD_TRACE_H
+#define MD_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   "MDTR"
+#define TRACE_VERSION 2
+
+#define TR_MALLOC  1
+#define TR_CALLOC  2
+#define TR_REALLOC 3
+#define TR_FREE    4
+#define TR_REALLOC_BEGIN 5 /* realloc is about to release ptr, see above */
+
+typedef struct TraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t rec_size; /* sizeof(TraceRec), so a reader can reject a mismatched build */
+    uint32_t pad;
+} TraceHeader;
+
+/* 48 bytes per call, 96 for a realloc */
+typedef struct TraceRec {
+    uint64_t seq;   /* position in causal order, see above */
+    uint64_t ts_ns; /* since the first recorded call */
+    uint64_t ptr;   /* block returned, or the block being freed */
+    uint64_t old;   /* realloc: the block being resized */
+    uint64_t size;  /* requested bytes, calloc records n * size */
+    uint32_t tid;
+    uint8_t op;     /* TR_* */
+    uint8_t pad[3];
+} TraceRec;
+
+#endif